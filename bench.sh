@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# run the benchmarks on the given .chm files, e.g.
+#   ./bench.sh ~/Downloads/chmdocs/*.chm > bench_output.txt
+# and compare the JSON lines of two builds
+
+set -o nounset
+set -o errexit
+set -o pipefail
+
+source ./build_common.sh
+
+build_bench >&2
+
+if [ $# -gt 0 ]; then
+  obj/bench/bench "$@"
+elif [ -e ~/Downloads/chmdocs ]; then
+  obj/bench/bench ~/Downloads/chmdocs/*.chm
+fi
@@ -3,35 +3,48 @@
 ## Available defines for building chm_lib with particular options
 # CHM_USE_PREAD: build chm_lib to use pread/pread64 for all I/O
 # CHM_USE_IO64:  build chm_lib to support 64-bit file I/O
+# CHM_CACHE_SHARDS: number of independently locked parts of the block cache (16)
+# CHM_READAHEAD_BLOCKS: number of blocks read ahead by chm_extract_all() (16)
+# CHM_LZX_POOL_SIZE: idle decompressor states kept per window size for reuse (4)
+#
+## Defines for chm_http, passed in HTTP_FLAGS together with the libraries they need
+# CHM_HTTP_GZIP:   cache and send gzip compressed entries (-lz)
+# CHM_HTTP_BROTLI: cache and send brotli compressed entries (-lbrotlienc)
+#
+#HTTP_FLAGS="-DCHM_HTTP_GZIP -lz"
 #
 #CFLAGS=-DCHM_USE_PREAD -DCHM_USE_IO64
 #CFLAGS=-DCHM_USE_PREAD -DCHM_USE_IO64 -g -DDMALLOC_DISABLE
 #LDFLAGS=-lpthread
 #
+# chm_lib uses pthreads for the block cache shared between sessions, so -pthread
+# is part of CFLAGS below
+#
 # ASAN only seems to work with -O0 (intentionally inserted bug didn't trigger
 # when I compiled with -O1, -O2 and -O3, but maybe it's because aggresive
 # optimizations eliminated the code completely)
 
 CHM_SRCS="src/chm_lib.c src/lzx.c"
+HTTP_FLAGS=${HTTP_FLAGS:-}
 
 clang_rel()
 {
   echo "clang_rel"
   CC=clang
-  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
+  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion -pthread"
   OUT=obj/clang/rel
   mkdir -p $OUT
   $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
   $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
   $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $HTTP_FLAGS
 }
 
 build_afl()
 {
   echo "build_afl"
   CC=afl-clang
-  CFLAGS="-g -fsanitize=address -O3 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
+  CFLAGS="-g -fsanitize=address -O3 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion -pthread"
   OUT=obj/afl/rel
   mkdir -p $OUT
   $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
@@ -44,7 +57,7 @@ clang_rel_one()
 {
   echo "clang_rel_on"
   CC=clang
-  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
+  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion -pthread"
   OUT=obj/clang/rel
   mkdir -p $OUT
   $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
@@ -55,13 +68,13 @@ clang_dbg()
 {
   echo "clang_dbg"
   CC=clang
-  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion"
+  CFLAGS="-g -fsanitize=address -O0 -Isrc -Weverything -Wno-format-nonliteral -Wno-padded -Wno-conversion -pthread"
   OUT=obj/clang/dbg
   mkdir -p $OUT
   $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
   $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
   $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $HTTP_FLAGS
 }
 
 gcc_rel()
@@ -69,11 +82,22 @@ gcc_rel()
   echo "gcc_rel"
   #CC=/usr/local/opt/gcc/bin/gcc-5
   CC=gcc-5 # this is on mac when installed with brew install gcc
-  CFLAGS="-g -O3 -Isrc -Wall -Wextra -Wpedantic"
+  CFLAGS="-g -O3 -Isrc -Wall -Wextra -Wpedantic -pthread"
   OUT=obj/gcc/rel
   mkdir -p $OUT
   $CC -o $OUT/test $CFLAGS $CHM_SRCS tools/test.c tools/sha1.c
   $CC -o $OUT/extract $CFLAGS $CHM_SRCS tools/extract.c
   $CC -o $OUT/enum $CFLAGS $CHM_SRCS tools/enum.c
-  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c
+  $CC -o $OUT/chm_http $CFLAGS $CHM_SRCS tools/chm_http.c $HTTP_FLAGS
+}
+
+# optimized build of tools/bench.c, without sanitizers so the timings mean something
+build_bench()
+{
+  echo "build_bench"
+  CC=${CC:-cc}
+  CFLAGS="-g -O3 -DNDEBUG -Isrc -Wall -Wextra -pthread"
+  OUT=obj/bench
+  mkdir -p $OUT
+  $CC -o $OUT/bench $CFLAGS $CHM_SRCS tools/bench.c
 }
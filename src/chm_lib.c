@@ -56,6 +56,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
 /* #include <dmalloc.h> */
 #endif
 
@@ -66,6 +69,27 @@
 #define CHM_MAX_BLOCKS_CACHED 5
 #endif
 
+/* size of the reads used to parse the directory */
+#ifndef CHM_DIR_READ_LEN
+#define CHM_DIR_READ_LEN (1 << 20)
+#endif
+
+/* number of blocks sessions read ahead, see chm_session_set_readahead() */
+#ifndef CHM_READAHEAD_BLOCKS
+#define CHM_READAHEAD_BLOCKS 16
+#endif
+
+/* number of idle decompressor states of each window size kept for reuse by
+ * later sessions, see chm_clear_lzx_pool() */
+#ifndef CHM_LZX_POOL_SIZE
+#define CHM_LZX_POOL_SIZE 4
+#endif
+
+/* number of independently locked parts of the block cache */
+#ifndef CHM_CACHE_SHARDS
+#define CHM_CACHE_SHARDS 16
+#endif
+
 /* names of sections essential to decompression */
 #define CHMU_RESET_TABLE                                                                 \
     "::DataSpace/Storage/MSCompressed/Transform/{7FC28940-9D31-11D0-9B27-00A0C91E9C7C}/" \
@@ -79,6 +103,9 @@
 
 #define CHM_MAX_PATHLEN 512
 
+/* enough for 4 GB of 32 kB blocks, larger reset tables are read on demand */
+#define CHM_MAX_RESET_TABLE_ENTRIES (1 << 17)
+
 /* structure of PMGL headers */
 static const char _chm_pmgl_marker[4] = "PMGL";
 #define CHM_PMGL_LEN 0x14
@@ -90,6 +117,13 @@ typedef struct pgml_hdr {
     int32_t block_next;    /* 10 */
 } pgml_hdr;
 
+/* structure of PMGI headers */
+static const char _chm_pmgi_marker[4] = "PMGI";
+#define CHM_PMGI_LEN 0x08
+
+/* more levels than any real directory needs, protects against loops in broken files */
+#define CHM_MAX_INDEX_DEPTH 16
+
 /* structure of LZXC reset table */
 #define CHM_LZXC_RESETTABLE_V1_LEN 0x28
 
@@ -137,67 +171,141 @@ void fd_reader_close(fd_reader_ctx* ctx) {
     }
 }
 
-#if 0
-int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
-  fd_reader_ctx *ctx = (fd_reader_ctx*)ctx_arg;
-  if (ctx->fd == -1) {
-    return -1;
-  }
-  return pread64(ctx->fd, buf, (long)len, off);
-}
-#endif
-
+/* pread() doesn't change the file position so fd_reader can be used
+ * from several threads at once (except on Windows) */
 int64_t fd_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
     fd_reader_ctx* ctx = (fd_reader_ctx*)ctx_arg;
     if (ctx->fd == -1) {
         return -1;
     }
+#ifdef WIN32
+    /* no pread() so this isn't safe to use concurrently, use win_reader instead */
     int64_t oldOff = lseek(ctx->fd, 0, SEEK_CUR);
     lseek(ctx->fd, (long)off, SEEK_SET);
     int64_t n = read(ctx->fd, buf, (size_t)len);
     lseek(ctx->fd, (long)oldOff, SEEK_SET);
     return n;
+#else
+    return (int64_t)pread(ctx->fd, buf, (size_t)len, (off_t)off);
+#endif
 }
 
 #ifdef WIN32
 bool win_reader_init(win_reader_ctx* ctx, const WCHAR* path) {
     ctx->fh = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
                           FILE_ATTRIBUTE_NORMAL, NULL);
-  return ctx->fh != INVALID_HANDLE_VALUE)
+    return ctx->fh != INVALID_HANDLE_VALUE;
 }
 
 void win_reader_close(win_reader_ctx* ctx) {
-    if (h != INVALID_HANDLE_VALUE) {
-        CloseHandle(h);
+    if (ctx->fh != INVALID_HANDLE_VALUE) {
+        CloseHandle(ctx->fh);
     }
 }
 
+/* the offset is passed in OVERLAPPED instead of moving the file pointer
+ * so win_reader can be used from several threads at once */
 int64_t win_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
     win_reader_ctx* ctx = (win_reader_ctx*)ctx_arg;
-    int64_t n = 0, oldOs = 0;
-    if (h->fd == INVALID_HANDLE_VALUE)
+    if (ctx->fh == INVALID_HANDLE_VALUE)
         return -1;
 
-    /* NOTE: this might be better done with CreateFileMapping, et cetera... */
-    DWORD origOffsetLo = 0, origOffsetHi = 0;
-    DWORD offsetLo, offsetHi;
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)(off & 0xffffffffL);
+    ov.OffsetHigh = (DWORD)((off >> 32) & 0xffffffffL);
+
     DWORD actualLen = 0;
+    if (ReadFile(ctx->fh, buf, (DWORD)len, &actualLen, &ov) != TRUE)
+        return -1;
+    return actualLen;
+}
+#endif
 
-    offsetLo = (unsigned int)(off & 0xffffffffL);
-    offsetHi = (unsigned int)((off >> 32) & 0xffffffffL);
-    origOffsetLo = SetFilePointer(h->fh, 0, &origOffsetHi, FILE_CURRENT);
-    offsetLo = SetFilePointer(h->fh, offsetLo, &offsetHi, FILE_BEGIN);
+#ifdef WIN32
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path) {
+    memset(ctx, 0, sizeof(mmap_reader_ctx));
+    ctx->mapping = NULL;
+    ctx->fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+    if (ctx->fh == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(ctx->fh, &size)) {
+        goto Error;
+    }
+    if (size.QuadPart == 0) {
+        /* empty files can't be mapped */
+        return true;
+    }
+    ctx->mapping = CreateFileMappingA(ctx->fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (ctx->mapping == NULL) {
+        goto Error;
+    }
+    ctx->mem.data = MapViewOfFile(ctx->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (ctx->mem.data == NULL) {
+        goto Error;
+    }
+    ctx->mem.size = size.QuadPart;
+    return true;
+Error:
+    mmap_reader_close(ctx);
+    return false;
+}
 
-    if (ReadFile(h->fh, buf, (DWORD)len, &actualLen, NULL) == TRUE)
-        n = actualLen;
-    else
-        n = -1;
+void mmap_reader_close(mmap_reader_ctx* ctx) {
+    if (ctx->mem.data != NULL) {
+        UnmapViewOfFile(ctx->mem.data);
+    }
+    if (ctx->mapping != NULL) {
+        CloseHandle(ctx->mapping);
+    }
+    if (ctx->fh != INVALID_HANDLE_VALUE) {
+        CloseHandle(ctx->fh);
+    }
+    memset(ctx, 0, sizeof(mmap_reader_ctx));
+    ctx->fh = INVALID_HANDLE_VALUE;
+}
+#else
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path) {
+    memset(ctx, 0, sizeof(mmap_reader_ctx));
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        void* d = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (d == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        ctx->mem.data = d;
+        ctx->mem.size = (int64_t)st.st_size;
+    }
+    /* the mapping stays valid after the file is closed */
+    close(fd);
+    return true;
+}
 
-    SetFilePointer(h->fh, origOffsetLo, &origOffsetHi, FILE_BEGIN);
-    return n;
+void mmap_reader_close(mmap_reader_ctx* ctx) {
+    if (ctx->mem.data != NULL) {
+        munmap(ctx->mem.data, (size_t)ctx->mem.size);
+    }
+    memset(ctx, 0, sizeof(mmap_reader_ctx));
 }
 #endif
 
+int64_t mmap_reader(void* ctx_arg, void* buf, int64_t off, int64_t len) {
+    mmap_reader_ctx* ctx = (mmap_reader_ctx*)ctx_arg;
+    return mem_reader(&ctx->mem, buf, off, len);
+}
+
 #if defined(WIN32)
 /* TODO: http://download.redis.io/redis-stable/deps/jemalloc/include/msvc_compat/strings.h
 https://msdn.microsoft.com/en-us/library/fbxyd7zd.aspx
@@ -221,6 +329,61 @@ void chm_set_dbgprint(dbgprintfunc f) {
     g_dbg_print = f;
 }
 
+static void* default_alloc(void* ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void* default_realloc(void* ctx, void* p, size_t size) {
+    (void)ctx;
+    return realloc(p, size);
+}
+
+static void default_free(void* ctx, void* p) {
+    (void)ctx;
+    free(p);
+}
+
+static chm_allocator g_allocator = {default_alloc, default_realloc, default_free, NULL};
+
+void chm_set_allocator(const chm_allocator* a) {
+    /* pooled states belong to the old allocator */
+    chm_clear_lzx_pool();
+    if (a == NULL) {
+        g_allocator.alloc = default_alloc;
+        g_allocator.realloc = default_realloc;
+        g_allocator.free = default_free;
+        g_allocator.ctx = NULL;
+        return;
+    }
+    g_allocator = *a;
+}
+
+void* chm_alloc(size_t size) {
+    return g_allocator.alloc(g_allocator.ctx, size);
+}
+
+void chm_free(void* p) {
+    if (p != NULL) {
+        g_allocator.free(g_allocator.ctx, p);
+    }
+}
+
+static void* chm_calloc(size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+    void* p = chm_alloc(n * size);
+    if (p != NULL) {
+        memset(p, 0, n * size);
+    }
+    return p;
+}
+
+static void* chm_realloc(void* p, size_t size) {
+    return g_allocator.realloc(g_allocator.ctx, p, size);
+}
+
 static void dbgprintf(const char* fmt, ...) {
     if (g_dbg_print == NULL) {
         return;
@@ -254,6 +417,290 @@ static int streq(const char* s1, const char* s2) {
     return strcasecmp(s1, s2) == 0;
 }
 
+/* an entry found by chm_find_entry() before chm_load_entries() */
+typedef struct chm_resolved_entry {
+    struct chm_resolved_entry* next;
+    chm_entry e;
+    char path[];
+} resolved_entry;
+
+#ifdef WIN32
+typedef CRITICAL_SECTION chm_mutex;
+
+static void mutex_init(chm_mutex* m) {
+    InitializeCriticalSection(m);
+}
+
+static void mutex_destroy(chm_mutex* m) {
+    DeleteCriticalSection(m);
+}
+
+static void mutex_lock(chm_mutex* m) {
+    EnterCriticalSection(m);
+}
+
+static void mutex_unlock(chm_mutex* m) {
+    LeaveCriticalSection(m);
+}
+
+static int32_t atomic_inc(volatile int32_t* v) {
+    return (int32_t)InterlockedIncrement((volatile LONG*)v);
+}
+
+static int32_t atomic_dec(volatile int32_t* v) {
+    return (int32_t)InterlockedDecrement((volatile LONG*)v);
+}
+
+static int64_t atomic_add64(volatile int64_t* v, int64_t n) {
+    return InterlockedExchangeAdd64((volatile LONGLONG*)v, n) + n;
+}
+
+static int64_t atomic_load64(volatile int64_t* v) {
+    return InterlockedCompareExchange64((volatile LONGLONG*)v, 0, 0);
+}
+
+static void atomic_store64(volatile int64_t* v, int64_t n) {
+    InterlockedExchange64((volatile LONGLONG*)v, n);
+}
+
+/* monotonic clock for chm_stats, in nanoseconds */
+static int64_t now_ns(void) {
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (int64_t)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+
+typedef CONDITION_VARIABLE chm_cond;
+
+static void cond_init(chm_cond* c) {
+    InitializeConditionVariable(c);
+}
+
+static void cond_destroy(chm_cond* c) {
+    (void)c;
+}
+
+static void cond_wait(chm_cond* c, chm_mutex* m) {
+    SleepConditionVariableCS(c, m, INFINITE);
+}
+
+static void cond_broadcast(chm_cond* c) {
+    WakeAllConditionVariable(c);
+}
+
+typedef HANDLE chm_thread;
+
+typedef struct thread_start_args {
+    void (*fn)(void*);
+    void* arg;
+} thread_start_args;
+
+static DWORD WINAPI thread_trampoline(LPVOID p) {
+    thread_start_args args = *(thread_start_args*)p;
+    chm_free(p);
+    args.fn(args.arg);
+    return 0;
+}
+
+static bool thread_start(chm_thread* t, void (*fn)(void*), void* arg) {
+    thread_start_args* args = (thread_start_args*)chm_alloc(sizeof(thread_start_args));
+    if (args == NULL) {
+        return false;
+    }
+    args->fn = fn;
+    args->arg = arg;
+    *t = CreateThread(NULL, 0, thread_trampoline, args, 0, NULL);
+    if (*t == NULL) {
+        chm_free(args);
+        return false;
+    }
+    return true;
+}
+
+static void thread_join(chm_thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static resolved_entry* atomic_load_entry(resolved_entry** p) {
+    return (resolved_entry*)InterlockedCompareExchangePointer((PVOID volatile*)p, NULL, NULL);
+}
+
+static bool atomic_cas_entry(resolved_entry** p, resolved_entry* expected,
+                             resolved_entry* desired) {
+    return InterlockedCompareExchangePointer((PVOID volatile*)p, desired, expected) == expected;
+}
+
+static struct lzx_state* atomic_xchg_state(struct lzx_state** p, struct lzx_state* v) {
+    return (struct lzx_state*)InterlockedExchangePointer((PVOID volatile*)p, v);
+}
+
+static bool atomic_cas_state(struct lzx_state** p, struct lzx_state* expected,
+                             struct lzx_state* desired) {
+    return InterlockedCompareExchangePointer((PVOID volatile*)p, desired, expected) == expected;
+}
+#else
+typedef pthread_mutex_t chm_mutex;
+
+static void mutex_init(chm_mutex* m) {
+    pthread_mutex_init(m, NULL);
+}
+
+static void mutex_destroy(chm_mutex* m) {
+    pthread_mutex_destroy(m);
+}
+
+static void mutex_lock(chm_mutex* m) {
+    pthread_mutex_lock(m);
+}
+
+static void mutex_unlock(chm_mutex* m) {
+    pthread_mutex_unlock(m);
+}
+
+static int32_t atomic_inc(volatile int32_t* v) {
+    return __atomic_add_fetch(v, 1, __ATOMIC_ACQ_REL);
+}
+
+static int32_t atomic_dec(volatile int32_t* v) {
+    return __atomic_sub_fetch(v, 1, __ATOMIC_ACQ_REL);
+}
+
+static int64_t atomic_add64(volatile int64_t* v, int64_t n) {
+    return __atomic_add_fetch(v, n, __ATOMIC_ACQ_REL);
+}
+
+static int64_t atomic_load64(volatile int64_t* v) {
+    return __atomic_load_n(v, __ATOMIC_ACQUIRE);
+}
+
+static void atomic_store64(volatile int64_t* v, int64_t n) {
+    __atomic_store_n(v, n, __ATOMIC_RELEASE);
+}
+
+/* monotonic clock for chm_stats, in nanoseconds */
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef pthread_cond_t chm_cond;
+
+static void cond_init(chm_cond* c) {
+    pthread_cond_init(c, NULL);
+}
+
+static void cond_destroy(chm_cond* c) {
+    pthread_cond_destroy(c);
+}
+
+static void cond_wait(chm_cond* c, chm_mutex* m) {
+    pthread_cond_wait(c, m);
+}
+
+static void cond_broadcast(chm_cond* c) {
+    pthread_cond_broadcast(c);
+}
+
+typedef pthread_t chm_thread;
+
+typedef struct thread_start_args {
+    void (*fn)(void*);
+    void* arg;
+} thread_start_args;
+
+static void* thread_trampoline(void* p) {
+    thread_start_args args = *(thread_start_args*)p;
+    chm_free(p);
+    args.fn(args.arg);
+    return NULL;
+}
+
+static bool thread_start(chm_thread* t, void (*fn)(void*), void* arg) {
+    thread_start_args* args = (thread_start_args*)chm_alloc(sizeof(thread_start_args));
+    if (args == NULL) {
+        return false;
+    }
+    args->fn = fn;
+    args->arg = arg;
+    if (pthread_create(t, NULL, thread_trampoline, args) != 0) {
+        chm_free(args);
+        return false;
+    }
+    return true;
+}
+
+static void thread_join(chm_thread t) {
+    pthread_join(t, NULL);
+}
+
+static resolved_entry* atomic_load_entry(resolved_entry** p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static bool atomic_cas_entry(resolved_entry** p, resolved_entry* expected,
+                             resolved_entry* desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+}
+
+static struct lzx_state* atomic_xchg_state(struct lzx_state** p, struct lzx_state* v) {
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+static bool atomic_cas_state(struct lzx_state** p, struct lzx_state* expected,
+                             struct lzx_state* desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED);
+}
+#endif
+
+/* idle decompressor states by window size (2^15 to 2^21 bytes). Sessions
+ * take one when they first decompress and give it back when they're freed,
+ * so opening many archives one after the other doesn't allocate and fault
+ * in a new window for every one */
+static struct lzx_state* g_lzx_pool[7][CHM_LZX_POOL_SIZE];
+
+static struct lzx_state* lzx_pool_get(int window) {
+    if (window < 15 || window > 21) {
+        return NULL;
+    }
+    struct lzx_state** pool = g_lzx_pool[window - 15];
+    for (int i = 0; i < CHM_LZX_POOL_SIZE; i++) {
+        struct lzx_state* state = atomic_xchg_state(&pool[i], NULL);
+        if (state != NULL && lzx_rebind(state, window) == DECR_OK) {
+            return state;
+        }
+        lzx_teardown(state);
+    }
+    return lzx_init(window);
+}
+
+static void lzx_pool_put(struct lzx_state* state, int window) {
+    if (state == NULL) {
+        return;
+    }
+    if (window >= 15 && window <= 21) {
+        struct lzx_state** pool = g_lzx_pool[window - 15];
+        for (int i = 0; i < CHM_LZX_POOL_SIZE; i++) {
+            if (atomic_cas_state(&pool[i], NULL, state)) {
+                return;
+            }
+        }
+    }
+    lzx_teardown(state);
+}
+
+void chm_clear_lzx_pool(void) {
+    for (int w = 0; w < 7; w++) {
+        for (int i = 0; i < CHM_LZX_POOL_SIZE; i++) {
+            lzx_teardown(atomic_xchg_state(&g_lzx_pool[w][i], NULL));
+        }
+    }
+}
+
 typedef struct unmarshaller {
     uint8_t* d;
     int bytesLeft;
@@ -531,113 +978,908 @@ static bool parse_lzxc_control_data(chm_file* h, chm_entry* e, int64_t n,
     return unmarshal_lzxc_control_data(&u, ctl_data);
 }
 
-static int64_t read_bytes(chm_file* h, uint8_t* buf, int64_t off, int64_t len) {
-    int64_t n = h->read_func(h->read_ctx, buf, off, len);
-    /*printf("read_bytes: %d@%d => %d\n", (int)len, (int)off, (int)n); */
-    return n;
+/* the whole file if the reader holds it in memory, NULL otherwise */
+static mem_reader_ctx* reader_mem(chm_file* h) {
+    if (h->read_func == mem_reader) {
+        return (mem_reader_ctx*)h->read_ctx;
+    }
+    if (h->read_func == mmap_reader) {
+        return &((mmap_reader_ctx*)h->read_ctx)->mem;
+    }
+    return NULL;
+}
+
+/* pointer to len bytes at off in the file, if the reader holds it in memory */
+static const uint8_t* reader_ptr(chm_file* h, int64_t off, int64_t len) {
+    mem_reader_ctx* ctx = reader_mem(h);
+    if (ctx != NULL && off >= 0 && len >= 0 && len <= ctx->size - off) {
+        return (const uint8_t*)ctx->data + off;
+    }
+    return NULL;
 }
 
 static bool is_null_or_compressed(chm_entry* e) {
     return (e == NULL) || (e->space == CHM_COMPRESSED);
 }
 
-static void free_entries(chm_entry* first) {
-    chm_entry* next;
-    chm_entry* e = first;
+static void free_resolved_entries(resolved_entry* first) {
+    resolved_entry* next;
+    resolved_entry* e = first;
     while (e != NULL) {
         next = e->next;
-        free(e);
+        chm_free(e);
         e = next;
     }
 }
 
-/* close an ITS archive */
-void chm_close(chm_file* h) {
-    if (h == NULL) {
-        return;
+/* a decompressed block. It is reference counted so that a thread can keep
+ * using a block after another thread evicted it from the cache */
+typedef struct cache_block {
+    int64_t index;
+    volatile int32_t refs;
+    /* CLOCK weight, the block is evicted when the hand finds it at 0 */
+    int weight;
+    /* position in the shard's ring and next block in the same hash bucket */
+    int ring_pos;
+    struct cache_block* hash_next;
+    /* block_data, or the data of shared when the block was decompressed for
+     * another chm_file, see chm_set_dedup_bytes() */
+    uint8_t* data;
+    struct cache_block* shared;
+    uint8_t block_data[];
+} cache_block;
+
+static cache_block* cache_block_new(chm_file* h, int64_t nBlock) {
+    size_t blockSize = (size_t)h->reset_table.block_len;
+    cache_block* b = (cache_block*)chm_alloc(sizeof(cache_block) + blockSize);
+    if (b == NULL) {
+        return NULL;
     }
+    b->index = nBlock;
+    b->refs = 1;
+    b->weight = 0;
+    b->ring_pos = -1;
+    b->hash_next = NULL;
+    b->data = b->block_data;
+    b->shared = NULL;
+    return b;
+}
 
-    if (h->lzx_state)
-        lzx_teardown(h->lzx_state);
-
-    for (int i = 0; i < h->n_cache_blocks; i++) {
-        free(h->cache_blocks[i]);
+static void cache_block_release(cache_block* b) {
+    if (b != NULL && atomic_dec(&b->refs) == 0) {
+        cache_block_release(b->shared);
+        chm_free(b);
     }
-    if (h->entries != NULL) {
-        if (h->n_entries > 0) {
-            free_entries(h->entries[0]);
-        }
-        free(h->entries);
+}
+
+/* block nBlock of another chm_file with the same data as src, taking over the
+ * caller's reference to src */
+static cache_block* cache_block_alias(cache_block* src, int64_t nBlock) {
+    cache_block* b = (cache_block*)chm_alloc(sizeof(cache_block));
+    if (b == NULL) {
+        cache_block_release(src);
+        return NULL;
     }
+    b->index = nBlock;
+    b->refs = 1;
+    b->weight = 0;
+    b->ring_pos = -1;
+    b->hash_next = NULL;
+    b->data = src->data;
+    b->shared = src;
+    return b;
 }
 
-/*
- *  how many decompressed blocks should be cached?  A simple
- *  caching scheme is used, wherein the index of the block is
- *  used as a hash value, and hash collision results in the
- *  invalidation of the previously cached block.
- */
-void chm_set_cache_size(chm_file* h, int nCacheBlocks) {
-    if (nCacheBlocks == h->n_cache_blocks) {
-        return;
+/* identifies a decompressed block across chm_files, see chain_extend() */
+typedef struct dedup_key {
+    uint8_t digest[32];
+} dedup_key;
+
+/* SHA-256 as in FIPS 180-4. The keys must be collision resistant since a
+ * block shared under a key is served to every chm_file asking for it,
+ * including ones that may have been crafted to collide with another's */
+typedef struct sha256_state {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} sha256_state;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_init(sha256_state* st) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(st->h, iv, sizeof(iv));
+    st->len = 0;
+}
+
+static void sha256_compress(sha256_state* st, const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+               ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
     }
-    if (nCacheBlocks > MAX_CACHE_BLOCKS) {
-        nCacheBlocks = MAX_CACHE_BLOCKS;
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
-    uint8_t* newBlocks[MAX_CACHE_BLOCKS] = {0};
-    int64_t newIndices[MAX_CACHE_BLOCKS] = {0};
-
-    /* re-distribute old cached blocks */
-    for (int i = 0; i < h->n_cache_blocks; i++) {
-        int newSlot = (int)(h->cache_block_indices[i] % nCacheBlocks);
+    uint32_t v[8];
+    memcpy(v, st->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^ rotr32(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^ rotr32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+    for (int i = 0; i < 8; i++) {
+        st->h[i] += v[i];
+    }
+}
 
-        if (h->cache_blocks[i]) {
-            /* in case of collision, destroy newcomer */
-            if (newBlocks[newSlot]) {
-                free(h->cache_blocks[i]);
-                h->cache_blocks[i] = NULL;
-            } else {
-                newBlocks[newSlot] = h->cache_blocks[i];
-                newIndices[newSlot] = h->cache_block_indices[i];
-            }
+static void sha256_update(sha256_state* st, const uint8_t* data, int64_t len) {
+    int fill = (int)(st->len & 63);
+    st->len += (uint64_t)len;
+    if (fill != 0) {
+        int n = len < 64 - fill ? (int)len : 64 - fill;
+        memcpy(st->buf + fill, data, (size_t)n);
+        data += n;
+        len -= n;
+        if (fill + n < 64) {
+            return;
         }
+        sha256_compress(st, st->buf);
     }
-
-    memcpy(h->cache_blocks, newBlocks, sizeof(newBlocks));
-    memcpy(h->cache_block_indices, newIndices, sizeof(newIndices));
-    h->n_cache_blocks = nCacheBlocks;
+    for (; len >= 64; data += 64, len -= 64) {
+        sha256_compress(st, data);
+    }
+    memcpy(st->buf, data, (size_t)len);
 }
 
-static uint8_t* get_cached_block(chm_file* h, int64_t nBlock) {
-    int idx = (int)nBlock % h->n_cache_blocks;
-    if (h->cache_blocks[idx] != NULL && h->cache_block_indices[idx] == nBlock) {
-        return h->cache_blocks[idx];
+static void sha256_update_u64(sha256_state* st, uint64_t n) {
+    uint8_t buf[8];
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (uint8_t)(n >> (8 * i));
     }
-    return NULL;
+    sha256_update(st, buf, 8);
 }
 
-static uint8_t* alloc_cached_block(chm_file* h, int64_t nBlock) {
-    int idx = (int)(nBlock % h->n_cache_blocks);
-    if (!h->cache_blocks[idx]) {
-        size_t blockSize = (size_t)h->reset_table.block_len;
-        h->cache_blocks[idx] = (uint8_t*)malloc(blockSize);
+static void sha256_final(sha256_state* st, dedup_key* key) {
+    uint64_t bits = st->len * 8;
+    int fill = (int)(st->len & 63);
+    st->buf[fill++] = 0x80;
+    if (fill > 56) {
+        memset(st->buf + fill, 0, (size_t)(64 - fill));
+        sha256_compress(st, st->buf);
+        fill = 0;
     }
-    if (h->cache_blocks[idx]) {
-        h->cache_block_indices[idx] = nBlock;
+    memset(st->buf + fill, 0, (size_t)(56 - fill));
+    for (int i = 0; i < 8; i++) {
+        st->buf[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sha256_compress(st, st->buf);
+    for (int i = 0; i < 32; i++) {
+        key->digest[i] = (uint8_t)(st->h[i / 4] >> (24 - 8 * (i % 4)));
     }
-    return h->cache_blocks[idx];
 }
 
-static int flags_from_path(char* path) {
-    int flags = 0;
-    size_t n = strlen(path);
+/* decompressed blocks shared by all chm_files, see chm_set_dedup_bytes().
+ * Entries hold a reference to a block of the chm_file that decompressed it
+ * and are evicted least recently used first */
+typedef struct dedup_entry {
+    dedup_key key;
+    cache_block* block;
+    int64_t len;
+    struct dedup_entry* hash_next;
+    struct dedup_entry* prev;
+    struct dedup_entry* next;
+} dedup_entry;
+
+typedef struct dedup_cache {
+    /* initialized by the first chm_set_dedup_bytes() */
+    bool init;
+    chm_mutex mutex;
+    dedup_entry** buckets;
+    int64_t n_buckets; /* power of 2 */
+    dedup_entry* lru_head;
+    dedup_entry* lru_tail;
+    volatile int64_t max_bytes;
+    int64_t bytes;
+} dedup_cache;
+
+static dedup_cache g_dedup;
+
+static bool dedup_enabled(void) {
+    return atomic_load64(&g_dedup.max_bytes) > 0;
+}
 
-    if (path[n - 1] == '/')
-        flags |= CHM_ENUMERATE_DIRS;
-    else
-        flags |= CHM_ENUMERATE_FILES;
+static dedup_entry** dedup_bucket(const dedup_key* key) {
+    uint64_t h = 0;
+    for (int i = 0; i < 8; i++) {
+        h = (h << 8) | key->digest[i];
+    }
+    return &g_dedup.buckets[h & (uint64_t)(g_dedup.n_buckets - 1)];
+}
 
-    if (n > 0 && path[0] == '/') {
+static void dedup_unlink(dedup_entry* e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        g_dedup.lru_head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        g_dedup.lru_tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void dedup_push(dedup_entry* e) {
+    e->prev = NULL;
+    e->next = g_dedup.lru_head;
+    if (g_dedup.lru_head != NULL) {
+        g_dedup.lru_head->prev = e;
+    } else {
+        g_dedup.lru_tail = e;
+    }
+    g_dedup.lru_head = e;
+}
+
+/* evict until the cache fits in max_bytes. Called with the lock held */
+static void dedup_shrink(void) {
+    while (g_dedup.lru_tail != NULL && g_dedup.bytes > atomic_load64(&g_dedup.max_bytes)) {
+        dedup_entry* e = g_dedup.lru_tail;
+        dedup_entry** p = dedup_bucket(&e->key);
+        while (*p != e) {
+            p = &(*p)->hash_next;
+        }
+        *p = e->hash_next;
+        dedup_unlink(e);
+        g_dedup.bytes -= e->len;
+        cache_block_release(e->block);
+        chm_free(e);
+    }
+}
+
+/* the block with the given key, with a reference the caller must release */
+static cache_block* dedup_find(const dedup_key* key) {
+    cache_block* b = NULL;
+    mutex_lock(&g_dedup.mutex);
+    if (g_dedup.buckets != NULL) {
+        for (dedup_entry* e = *dedup_bucket(key); e != NULL; e = e->hash_next) {
+            if (memcmp(e->key.digest, key->digest, sizeof(key->digest)) == 0) {
+                dedup_unlink(e);
+                dedup_push(e);
+                b = e->block;
+                atomic_inc(&b->refs);
+                break;
+            }
+        }
+    }
+    mutex_unlock(&g_dedup.mutex);
+    return b;
+}
+
+/* share b, which must not be an alias, under key unless there's a block for it */
+static void dedup_insert(const dedup_key* key, cache_block* b, int64_t len) {
+    dedup_entry* e = (dedup_entry*)chm_alloc(sizeof(dedup_entry));
+    if (e == NULL) {
+        return;
+    }
+    mutex_lock(&g_dedup.mutex);
+    if (g_dedup.buckets != NULL && len <= atomic_load64(&g_dedup.max_bytes)) {
+        dedup_entry** bucket = dedup_bucket(key);
+        dedup_entry* old = *bucket;
+        while (old != NULL && memcmp(old->key.digest, key->digest, sizeof(key->digest)) != 0) {
+            old = old->hash_next;
+        }
+        if (old == NULL) {
+            e->key = *key;
+            e->block = b;
+            e->len = len;
+            atomic_inc(&b->refs);
+            e->hash_next = *bucket;
+            *bucket = e;
+            dedup_push(e);
+            g_dedup.bytes += len;
+            e = NULL;
+            dedup_shrink();
+        }
+    }
+    mutex_unlock(&g_dedup.mutex);
+    chm_free(e);
+}
+
+void chm_set_dedup_bytes(int64_t maxBytes) {
+    if (!g_dedup.init) {
+        mutex_init(&g_dedup.mutex);
+        g_dedup.init = true;
+    }
+    if (maxBytes < 0) {
+        maxBytes = 0;
+    }
+    mutex_lock(&g_dedup.mutex);
+    /* about one bucket per 32 kB block */
+    int64_t nBuckets = 256;
+    while (nBuckets < maxBytes / 0x8000 && nBuckets < (1 << 20)) {
+        nBuckets *= 2;
+    }
+    if (maxBytes > 0 && nBuckets > g_dedup.n_buckets) {
+        dedup_entry** buckets = (dedup_entry**)chm_calloc((size_t)nBuckets, sizeof(dedup_entry*));
+        if (buckets == NULL) {
+            maxBytes = g_dedup.buckets != NULL ? maxBytes : 0;
+        } else {
+            dedup_entry** old = g_dedup.buckets;
+            int64_t nOld = g_dedup.n_buckets;
+            g_dedup.buckets = buckets;
+            g_dedup.n_buckets = nBuckets;
+            for (int64_t i = 0; i < nOld; i++) {
+                dedup_entry* e = old[i];
+                while (e != NULL) {
+                    dedup_entry* next = e->hash_next;
+                    dedup_entry** bucket = dedup_bucket(&e->key);
+                    e->hash_next = *bucket;
+                    *bucket = e;
+                    e = next;
+                }
+            }
+            chm_free(old);
+        }
+    }
+    atomic_store64(&g_dedup.max_bytes, maxBytes);
+    dedup_shrink();
+    if (maxBytes == 0) {
+        chm_free(g_dedup.buckets);
+        g_dedup.buckets = NULL;
+        g_dedup.n_buckets = 0;
+    }
+    mutex_unlock(&g_dedup.mutex);
+}
+
+/* The cache is bounded by the number of bytes in cached blocks, not by the
+ * number of blocks. Blocks are distributed over shards by block index, each
+ * shard has its own lock so that threads working on different blocks don't
+ * contend.
+ *
+ * Eviction uses the CLOCK algorithm over a ring of the shard's blocks. A
+ * block gets a weight when it's inserted and every time it's hit, and the
+ * hand decrements the weight of a block each time it passes it. The weight
+ * depends on how expensive the block is to rebuild: block k of a reset
+ * interval can only be decompressed by decompressing all blocks since the
+ * reset point, so blocks far from the reset point survive longer than the
+ * ones next to it. */
+typedef struct cache_shard {
+    chm_mutex mutex;
+    cache_block** ring;
+    int n_blocks;
+    int ring_cap;
+    int hand;
+    cache_block** buckets;
+    int n_buckets; /* power of 2 */
+
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+} cache_shard;
+
+struct chm_cache {
+    cache_shard shards[CHM_CACHE_SHARDS];
+    int64_t block_len;
+    uint32_t reset_blkcount;
+    volatile int64_t max_bytes;
+    volatile int64_t used_bytes;
+    /* next shard to evict from when the shard being inserted into is empty */
+    volatile int32_t evict_shard;
+
+    /* decompressor snapshots, see chm_set_checkpoints() */
+    chm_mutex ckpt_mutex;
+    uint32_t ckpt_interval;
+    int64_t ckpt_max_bytes;
+    int64_t ckpt_bytes;
+    uint8_t** ckpts;
+    int64_t n_ckpts;
+
+    /* counters of chm_get_stats(), updated by all sessions */
+    volatile int64_t n_reads;
+    volatile int64_t n_read_bytes;
+    volatile int64_t n_decoded;
+    volatile int64_t n_redecoded;
+    volatile int64_t n_ckpt_restores;
+    volatile int64_t decode_ns;
+    volatile int64_t n_dedup_hits;
+    /* see chm_set_event_hook() */
+    chm_event_func event_func;
+    void* event_ctx;
+
+    /* keys of the blocks for chm_set_dedup_bytes(), valid where chain_known is
+     * set. NULL if the file was parsed with the dedup cache off */
+    chm_mutex chain_mutex;
+    dedup_key* chain;
+    uint8_t* chain_known;
+    int64_t n_chain;
+    /* window size, which the keys depend on */
+    uint32_t window_size;
+};
+
+static void report_event(chm_cache* c, chm_event_type type, int64_t off, int64_t len,
+                         int64_t ns) {
+    chm_event ev;
+    ev.type = type;
+    ev.off = off;
+    ev.len = len;
+    ev.ns = ns;
+    c->event_func(c->event_ctx, &ev);
+}
+
+static int64_t read_bytes(chm_file* h, uint8_t* buf, int64_t off, int64_t len) {
+    chm_cache* c = h->cache;
+    /* only time reads for the hook, they're often too quick to be worth it */
+    int64_t start = (c && c->event_func) ? now_ns() : 0;
+    int64_t n = h->read_func(h->read_ctx, buf, off, len);
+    /*printf("read_bytes: %d@%d => %d\n", (int)len, (int)off, (int)n); */
+    if (c != NULL) {
+        atomic_add64(&c->n_reads, 1);
+        atomic_add64(&c->n_read_bytes, n > 0 ? n : 0);
+        if (c->event_func) {
+            report_event(c, CHM_EVENT_READ, off, n, now_ns() - start);
+        }
+    }
+    return n;
+}
+
+#define CACHE_MAX_WEIGHT 4
+
+static int cache_weight(chm_cache* c, int64_t nBlock) {
+    uint32_t align = c->reset_blkcount ? (uint32_t)(nBlock % c->reset_blkcount) : 0;
+    int weight = 1;
+    for (uint32_t n = 1; n <= align && weight < CACHE_MAX_WEIGHT; n <<= 2) {
+        weight++;
+    }
+    return weight;
+}
+
+static chm_cache* cache_new(void) {
+    chm_cache* c = (chm_cache*)chm_calloc(1, sizeof(chm_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < CHM_CACHE_SHARDS; i++) {
+        mutex_init(&c->shards[i].mutex);
+    }
+    mutex_init(&c->ckpt_mutex);
+    mutex_init(&c->chain_mutex);
+    return c;
+}
+
+static void free_checkpoints(chm_cache* c) {
+    for (int64_t i = 0; i < c->n_ckpts; i++) {
+        chm_free(c->ckpts[i]);
+    }
+    chm_free(c->ckpts);
+    c->ckpts = NULL;
+    c->n_ckpts = 0;
+    c->ckpt_bytes = 0;
+    c->ckpt_interval = 0;
+}
+
+static void cache_free(chm_cache* c) {
+    if (c == NULL) {
+        return;
+    }
+    free_checkpoints(c);
+    mutex_destroy(&c->ckpt_mutex);
+    chm_free(c->chain);
+    chm_free(c->chain_known);
+    mutex_destroy(&c->chain_mutex);
+    for (int i = 0; i < CHM_CACHE_SHARDS; i++) {
+        cache_shard* sh = &c->shards[i];
+        for (int j = 0; j < sh->n_blocks; j++) {
+            cache_block_release(sh->ring[j]);
+        }
+        chm_free(sh->ring);
+        chm_free(sh->buckets);
+        mutex_destroy(&sh->mutex);
+    }
+    chm_free(c);
+}
+
+static cache_shard* cache_shard_for(chm_cache* c, int64_t nBlock) {
+    return &c->shards[nBlock % CHM_CACHE_SHARDS];
+}
+
+static int cache_bucket_for(cache_shard* sh, int64_t nBlock) {
+    return (int)((nBlock / CHM_CACHE_SHARDS) & (sh->n_buckets - 1));
+}
+
+static cache_block* cache_shard_find(cache_shard* sh, int64_t nBlock) {
+    if (sh->n_buckets == 0) {
+        return NULL;
+    }
+    cache_block* b = sh->buckets[cache_bucket_for(sh, nBlock)];
+    while (b != NULL && b->index != nBlock) {
+        b = b->hash_next;
+    }
+    return b;
+}
+
+/* grow the ring and the hash table so that one more block fits */
+static bool cache_shard_reserve(cache_shard* sh) {
+    if (sh->n_blocks < sh->ring_cap) {
+        return true;
+    }
+    int newCap = sh->ring_cap ? sh->ring_cap * 2 : 8;
+    cache_block** ring =
+        (cache_block**)chm_realloc(sh->ring, (size_t)newCap * sizeof(cache_block*));
+    if (ring == NULL) {
+        return false;
+    }
+    sh->ring = ring;
+    sh->ring_cap = newCap;
+
+    cache_block** buckets = (cache_block**)chm_calloc((size_t)newCap, sizeof(cache_block*));
+    if (buckets == NULL) {
+        /* the old table still works, just with longer chains */
+        return sh->buckets != NULL;
+    }
+    chm_free(sh->buckets);
+    sh->buckets = buckets;
+    sh->n_buckets = newCap;
+    for (int i = 0; i < sh->n_blocks; i++) {
+        cache_block* b = sh->ring[i];
+        int idx = cache_bucket_for(sh, b->index);
+        b->hash_next = buckets[idx];
+        buckets[idx] = b;
+    }
+    return true;
+}
+
+static void cache_shard_remove(cache_shard* sh, cache_block* b) {
+    cache_block** pp = &sh->buckets[cache_bucket_for(sh, b->index)];
+    while (*pp != b) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = b->hash_next;
+    b->hash_next = NULL;
+
+    /* fill the hole in the ring with the last block */
+    int pos = b->ring_pos;
+    sh->n_blocks--;
+    if (pos != sh->n_blocks) {
+        sh->ring[pos] = sh->ring[sh->n_blocks];
+        sh->ring[pos]->ring_pos = pos;
+    }
+    b->ring_pos = -1;
+    if (sh->hand >= sh->n_blocks) {
+        sh->hand = 0;
+    }
+}
+
+/* advance the CLOCK hand until a block with weight 0 is found and remove it from
+ * the shard. Returns the removed block, with the reference the cache had on it */
+static cache_block* cache_shard_evict(cache_shard* sh) {
+    if (sh->n_blocks == 0) {
+        return NULL;
+    }
+    /* every block reaches weight 0 within CACHE_MAX_WEIGHT rounds */
+    for (int n = 0; n <= sh->n_blocks * CACHE_MAX_WEIGHT; n++) {
+        cache_block* b = sh->ring[sh->hand];
+        if (b->weight == 0) {
+            cache_shard_remove(sh, b);
+            sh->evictions++;
+            return b;
+        }
+        b->weight--;
+        sh->hand = (sh->hand + 1) % sh->n_blocks;
+    }
+    return NULL;
+}
+
+/* evict blocks until the cache fits in its budget */
+static void cache_shrink(chm_cache* c, int startShard) {
+    int emptyShards = 0;
+    int i = startShard;
+    while (atomic_load64(&c->used_bytes) > atomic_load64(&c->max_bytes)) {
+        cache_shard* sh = &c->shards[i];
+        mutex_lock(&sh->mutex);
+        cache_block* b = cache_shard_evict(sh);
+        mutex_unlock(&sh->mutex);
+        if (b != NULL) {
+            emptyShards = 0;
+            atomic_add64(&c->used_bytes, -c->block_len);
+            cache_block_release(b);
+            continue;
+        }
+        /* this shard is empty, take the next one */
+        if (++emptyShards == CHM_CACHE_SHARDS) {
+            break;
+        }
+        i = atomic_inc(&c->evict_shard) % CHM_CACHE_SHARDS;
+        if (i < 0) {
+            i += CHM_CACHE_SHARDS;
+        }
+    }
+}
+
+/* returns the cached block with a reference the caller must release */
+static cache_block* cache_get(chm_cache* c, int64_t nBlock) {
+    cache_shard* sh = cache_shard_for(c, nBlock);
+    mutex_lock(&sh->mutex);
+    cache_block* b = cache_shard_find(sh, nBlock);
+    if (b != NULL) {
+        atomic_inc(&b->refs);
+        b->weight = cache_weight(c, nBlock);
+        sh->hits++;
+    } else {
+        sh->misses++;
+    }
+    mutex_unlock(&sh->mutex);
+    return b;
+}
+
+/* the cache takes its own reference to b */
+static void cache_put(chm_cache* c, cache_block* b) {
+    if (atomic_load64(&c->max_bytes) < c->block_len) {
+        return;
+    }
+    cache_shard* sh = cache_shard_for(c, b->index);
+    mutex_lock(&sh->mutex);
+    cache_block* old = cache_shard_find(sh, b->index);
+    if (old != NULL) {
+        /* another session decompressed the same block in the meantime */
+        cache_shard_remove(sh, old);
+        atomic_add64(&c->used_bytes, -c->block_len);
+    }
+    if (!cache_shard_reserve(sh)) {
+        mutex_unlock(&sh->mutex);
+        cache_block_release(old);
+        return;
+    }
+    atomic_inc(&b->refs);
+    b->weight = cache_weight(c, b->index);
+    b->ring_pos = sh->n_blocks;
+    sh->ring[sh->n_blocks++] = b;
+    int idx = cache_bucket_for(sh, b->index);
+    b->hash_next = sh->buckets[idx];
+    sh->buckets[idx] = b;
+    atomic_add64(&c->used_bytes, c->block_len);
+    mutex_unlock(&sh->mutex);
+    cache_block_release(old);
+
+    cache_shrink(c, (int)(b->index % CHM_CACHE_SHARDS));
+}
+
+/* how many bytes of decompressed blocks should be cached? Safe to call while
+ * other sessions are reading. */
+void chm_set_cache_bytes(chm_file* h, int64_t maxBytes) {
+    chm_cache* c = h->cache;
+    if (maxBytes < 0) {
+        maxBytes = 0;
+    }
+    atomic_store64(&c->max_bytes, maxBytes);
+    cache_shrink(c, 0);
+}
+
+/* how many decompressed blocks should be cached? */
+void chm_set_cache_size(chm_file* h, int nCacheBlocks) {
+    int64_t blockLen = h->cache->block_len;
+    if (blockLen == 0) {
+        blockLen = 0x8000;
+    }
+    chm_set_cache_bytes(h, (int64_t)nCacheBlocks * blockLen);
+}
+
+void chm_set_checkpoints(chm_file* h, int nBlocks, int64_t maxBytes) {
+    chm_cache* c = h->cache;
+    free_checkpoints(c);
+    /* blocks at reset points don't need one */
+    if (!h->compression_enabled || nBlocks <= 0 || (uint32_t)nBlocks >= h->reset_blkcount ||
+        maxBytes <= 0) {
+        return;
+    }
+    int64_t n = (int64_t)h->reset_table.block_count / nBlocks + 1;
+    c->ckpts = (uint8_t**)chm_calloc((size_t)n, sizeof(uint8_t*));
+    if (c->ckpts == NULL) {
+        return;
+    }
+    c->n_ckpts = n;
+    c->ckpt_interval = (uint32_t)nBlocks;
+    c->ckpt_max_bytes = maxBytes;
+}
+
+/* save the state of a decompressor that is about to decompress nBlock, if
+ * there should be a checkpoint at nBlock and there's room for it */
+static void checkpoint_save(chm_cache* c, int64_t nBlock, struct lzx_state* state) {
+    if (c->ckpt_interval == 0 || nBlock % c->ckpt_interval != 0 ||
+        nBlock % c->reset_blkcount == 0 || nBlock / c->ckpt_interval >= c->n_ckpts) {
+        return;
+    }
+    int64_t idx = nBlock / c->ckpt_interval;
+    int64_t size = (int64_t)lzx_snapshot_size(state);
+
+    mutex_lock(&c->ckpt_mutex);
+    bool wanted = c->ckpts[idx] == NULL && c->ckpt_bytes + size <= c->ckpt_max_bytes;
+    mutex_unlock(&c->ckpt_mutex);
+    if (!wanted) {
+        return;
+    }
+
+    /* snapshot outside the lock, another session may have beaten us to it */
+    uint8_t* buf = (uint8_t*)chm_alloc((size_t)size);
+    if (buf == NULL) {
+        return;
+    }
+    lzx_snapshot(state, buf);
+    mutex_lock(&c->ckpt_mutex);
+    if (c->ckpts[idx] == NULL && c->ckpt_bytes + size <= c->ckpt_max_bytes) {
+        c->ckpts[idx] = buf;
+        c->ckpt_bytes += size;
+        buf = NULL;
+    }
+    mutex_unlock(&c->ckpt_mutex);
+    chm_free(buf);
+}
+
+/* restore the latest checkpoint after block after and at or before nBlock.
+ * Returns the block the decompressor is ready for or -1 if there's none */
+static int64_t checkpoint_restore(chm_cache* c, int64_t after, int64_t nBlock,
+                                  struct lzx_state* state) {
+    if (c->ckpt_interval == 0) {
+        return -1;
+    }
+    for (int64_t b = nBlock - nBlock % c->ckpt_interval; b > after; b -= c->ckpt_interval) {
+        int64_t idx = b / c->ckpt_interval;
+        if (idx >= c->n_ckpts) {
+            continue;
+        }
+        mutex_lock(&c->ckpt_mutex);
+        uint8_t* ckpt = c->ckpts[idx];
+        bool ok = ckpt != NULL && lzx_restore(state, ckpt) == DECR_OK;
+        mutex_unlock(&c->ckpt_mutex);
+        if (ok) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+void chm_get_cache_stats(chm_file* h, chm_cache_stats* stats) {
+    chm_cache* c = h->cache;
+    memzero(stats, sizeof(chm_cache_stats));
+    for (int i = 0; i < CHM_CACHE_SHARDS; i++) {
+        cache_shard* sh = &c->shards[i];
+        mutex_lock(&sh->mutex);
+        stats->hits += sh->hits;
+        stats->misses += sh->misses;
+        stats->evictions += sh->evictions;
+        stats->blocks += sh->n_blocks;
+        mutex_unlock(&sh->mutex);
+    }
+    stats->bytes = atomic_load64(&c->used_bytes);
+    stats->max_bytes = atomic_load64(&c->max_bytes);
+}
+
+void chm_get_stats(chm_file* h, chm_stats* stats) {
+    chm_cache* c = h->cache;
+    memzero(stats, sizeof(chm_stats));
+    stats->reads = atomic_load64(&c->n_reads);
+    stats->read_bytes = atomic_load64(&c->n_read_bytes);
+    stats->blocks_decoded = atomic_load64(&c->n_decoded);
+    stats->blocks_redecoded = atomic_load64(&c->n_redecoded);
+    stats->checkpoint_restores = atomic_load64(&c->n_ckpt_restores);
+    stats->decode_ns = atomic_load64(&c->decode_ns);
+    stats->blocks_deduped = atomic_load64(&c->n_dedup_hits);
+    chm_get_cache_stats(h, &stats->cache);
+}
+
+void chm_set_event_hook(chm_file* h, chm_event_func f, void* ctx) {
+    h->cache->event_ctx = ctx;
+    h->cache->event_func = f;
+}
+
+/* decompressor state private to a session */
+typedef struct readahead readahead;
+
+struct chm_session {
+    chm_file* h;
+
+    /* decompressor state, from the pool, and its window size in bits */
+    struct lzx_state* lzx_state;
+    int lzx_window;
+    /* last decompressed block, the session holds a reference to it */
+    cache_block* lzx_last_block;
+    /* last block decompress_block() got from the dedup cache, likewise */
+    cache_block* dedup_block;
+    /* compressed input of uncompress_block(), allocated on first use */
+    uint8_t* cmp_buf;
+
+    /* see chm_session_set_readahead() */
+    readahead* ra;
+    /* the last block decode_block() was called for and the number of blocks
+     * decoded in order before it */
+    int64_t last_decoded;
+    int n_sequential;
+};
+
+static void readahead_free(readahead* ra);
+
+chm_session* chm_session_new(chm_file* h) {
+    if (h == NULL) {
+        return NULL;
+    }
+    chm_session* s = (chm_session*)chm_calloc(1, sizeof(chm_session));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->h = h;
+    s->last_decoded = -1;
+    return s;
+}
+
+void chm_session_free(chm_session* s) {
+    if (s == NULL) {
+        return;
+    }
+    lzx_pool_put(s->lzx_state, s->lzx_window);
+    cache_block_release(s->lzx_last_block);
+    cache_block_release(s->dedup_block);
+    chm_free(s->cmp_buf);
+    readahead_free(s->ra);
+    chm_free(s);
+}
+
+/* close an ITS archive */
+void chm_close(chm_file* h) {
+    if (h == NULL) {
+        return;
+    }
+
+    chm_session_free(h->session);
+    h->session = NULL;
+    cache_free(h->cache);
+    h->cache = NULL;
+    chm_free(h->reset_offsets);
+    h->reset_offsets = NULL;
+    chm_free(h->path_index);
+    h->path_index = NULL;
+    free_resolved_entries(h->resolved_entries);
+    h->resolved_entries = NULL;
+    chm_free(h->entries);
+    h->entries = NULL;
+    chm_free(h->entry_paths);
+    h->entry_paths = NULL;
+}
+
+static int flags_from_path(char* path) {
+    int flags = 0;
+    size_t n = strlen(path);
+
+    if (path[n - 1] == '/')
+        flags |= CHM_ENUMERATE_DIRS;
+    else
+        flags |= CHM_ENUMERATE_FILES;
+
+    if (n > 0 && path[0] == '/') {
         if (n > 1 && (path[1] == '#' || path[1] == '$'))
             flags |= CHM_ENUMERATE_SPECIAL;
         else
@@ -647,26 +1889,33 @@ static int flags_from_path(char* path) {
     return flags;
 }
 
-static chm_entry* parse_pmgl_entry(unmarshaller* u) {
+/* read the path of a directory entry into dst, which has room for
+ * CHM_MAX_PATHLEN + 1 bytes */
+static bool get_entry_path(unmarshaller* u, char* dst) {
     size_t pathLen = (size_t)get_cword(u);
     if (pathLen > CHM_MAX_PATHLEN || !u->ok) {
-        return NULL;
+        return false;
     }
-    size_t n = sizeof(chm_entry) + pathLen + 1; /* +1 to nul-terminate */
-    chm_entry* e = (chm_entry*)calloc(1, n);
-    if (e == NULL) {
-        return NULL;
+    get_pchar(u, dst, (int)pathLen);
+    dst[pathLen] = 0;
+    return u->ok;
+}
+
+/* parse a PMGL entry into e. Its path is read into path, which has room
+ * for CHM_MAX_PATHLEN + 1 bytes */
+static bool parse_pmgl_entry(unmarshaller* u, chm_entry* e, char* path) {
+    if (!get_entry_path(u, path)) {
+        return false;
     }
-    e->path = (char*)e + sizeof(chm_entry);
-    get_pchar(u, e->path, (int)pathLen);
+    e->path = path;
     e->space = (int)get_cword(u);
     e->start = get_cword(u);
     e->length = get_cword(u);
     if (!u->ok) {
-        return NULL;
+        return false;
     }
-    e->flags = flags_from_path(e->path);
-    return e;
+    e->flags = flags_from_path(path);
+    return true;
 }
 
 static bool get_int64_at_off(chm_file* h, int64_t off, int64_t* n_out) {
@@ -684,110 +1933,533 @@ static bool get_int64_at_off(chm_file* h, int64_t off, int64_t* n_out) {
     return true;
 }
 
+/* offset of the first byte of the reset table entries */
+static int64_t reset_table_entries_off(chm_file* h) {
+    return (int64_t)h->itsf.data_offset + (int64_t)h->rt_unit->start +
+           (int64_t)h->reset_table.table_offset;
+}
+
+/* get entry n of the reset table i.e. the start of compressed block n */
+static bool get_reset_table_entry(chm_file* h, int64_t block, int64_t* n_out) {
+    if (block < h->n_reset_offsets) {
+        *n_out = h->reset_offsets[block];
+        return true;
+    }
+    /* not pre-loaded, see load_reset_table_entries() */
+    return get_int64_at_off(h, reset_table_entries_off(h) + block * 8, n_out);
+}
+
+/* true if block is the last one, whose end isn't in the reset table */
+static bool is_last_cmpblock(chm_file* h, int64_t block) {
+    return block >= h->reset_table.block_count - 1;
+}
+
+/* the bounds of a compressed block from its reset table entry and the next one's */
+static void cmpblock_bounds(chm_file* h, int64_t block, int64_t entry, int64_t nextEntry,
+                            int64_t* start, int64_t* len) {
+    int64_t end = is_last_cmpblock(h, block) ? h->reset_table.compressed_len : nextEntry;
+    *len = end - entry;
+    *start = entry + h->itsf.data_offset + h->cn_unit->start;
+}
+
 /* get the bounds of a compressed block.  return false on failure */
 static bool get_cmpblock_bounds(chm_file* h, int64_t block, int64_t* start, int64_t* len) {
-    int64_t off = (int64_t)h->itsf.data_offset + (int64_t)h->rt_unit->start +
-                  (int64_t)h->reset_table.table_offset + (int64_t)block * 8;
-    if (!get_int64_at_off(h, off, start)) {
+    int64_t entry;
+    if (!get_reset_table_entry(h, block, &entry)) {
         return false;
     }
 
     /* for all but the last block, use the reset table */
-    int64_t end = h->reset_table.compressed_len;
-    if (block < h->reset_table.block_count - 1) {
-        off += 8;
-        if (!get_int64_at_off(h, off, &end)) {
+    int64_t end = 0;
+    if (!is_last_cmpblock(h, block)) {
+        if (!get_reset_table_entry(h, block + 1, &end)) {
             return false;
         }
     }
 
-    *len = end - *start;
-    *start += h->itsf.data_offset + h->cn_unit->start;
+    cmpblock_bounds(h, block, entry, end, start, len);
     return true;
 }
 
-static uint8_t* uncompress_block(chm_file* h, int64_t nBlock) {
-    size_t blockSize = (size_t)h->reset_table.block_len;
-    // TODO: cache buf on chm_file
-
-    if (h->lzx_last_block == nBlock) {
-        return h->lzx_last_block_data;
+/* Blocks are shared by the dedup cache under the SHA-256 of their compressed
+ * data chained with the key of the block before them, back to their reset
+ * point, since a block's content depends on all the blocks decompressed before
+ * it. The key at a reset point starts from the window and block sizes. Set the
+ * key of block nBlock from its cmpLen bytes of compressed data at cmp, if the
+ * key of the block before it is known */
+static void chain_extend(chm_file* h, int64_t nBlock, const uint8_t* cmp, int64_t cmpLen) {
+    chm_cache* c = h->cache;
+    if (c->chain == NULL || nBlock < 0 || nBlock >= c->n_chain || !dedup_enabled()) {
+        return;
     }
-
-    if (nBlock % h->reset_blkcount == 0) {
-        lzx_reset(h->lzx_state);
+    uint32_t pos = (uint32_t)(nBlock % c->reset_blkcount);
+    dedup_key prev;
+    memset(&prev, 0, sizeof(prev));
+    mutex_lock(&c->chain_mutex);
+    bool known = c->chain_known[nBlock] || (pos != 0 && !c->chain_known[nBlock - 1]);
+    if (pos != 0) {
+        prev = c->chain[nBlock - 1];
+    }
+    mutex_unlock(&c->chain_mutex);
+    if (known) {
+        return;
     }
 
-    uint8_t* buf = malloc(blockSize + 6144);
-    if (buf == NULL)
-        return NULL;
+    sha256_state st;
+    sha256_init(&st);
+    if (pos == 0) {
+        sha256_update_u64(&st, (uint64_t)c->window_size);
+        sha256_update_u64(&st, (uint64_t)c->block_len);
+    } else {
+        sha256_update(&st, prev.digest, (int64_t)sizeof(prev.digest));
+    }
+    sha256_update_u64(&st, (uint64_t)cmpLen | ((uint64_t)pos << 32));
+    sha256_update(&st, cmp, cmpLen);
+    dedup_key k;
+    sha256_final(&st, &k);
+    mutex_lock(&c->chain_mutex);
+    c->chain[nBlock] = k;
+    c->chain_known[nBlock] = 1;
+    mutex_unlock(&c->chain_mutex);
+}
 
-    uint8_t* uncompressed = alloc_cached_block(h, nBlock);
-    if (!uncompressed) {
-        goto Error;
+static bool chain_get(chm_cache* c, int64_t nBlock, dedup_key* key) {
+    mutex_lock(&c->chain_mutex);
+    bool known = c->chain_known[nBlock] != 0;
+    if (known) {
+        *key = c->chain[nBlock];
     }
+    mutex_unlock(&c->chain_mutex);
+    return known;
+}
 
-    dbgprintf("Decompressing block #%4d (EXTRA)\n", nBlock);
-    int64_t cmpStart, cmpLen;
-    if (!get_cmpblock_bounds(h, nBlock, &cmpStart, &cmpLen)) {
-        goto Error;
+/* the key of block nBlock. If it's not known yet and mayRead, it's computed by
+ * reading the compressed data since the last block with a known key, which is
+ * cheap compared to decompressing them */
+static bool block_key(chm_session* s, int64_t nBlock, bool mayRead, dedup_key* key) {
+    chm_file* h = s->h;
+    chm_cache* c = h->cache;
+    if (chain_get(c, nBlock, key)) {
+        return true;
     }
-    if (cmpLen < 0 || cmpLen > (int64_t)blockSize + 6144) {
-        goto Error;
+    if (!mayRead) {
+        return false;
     }
-
-    if (read_bytes(h, buf, cmpStart, cmpLen) != cmpLen) {
-        goto Error;
+    int64_t first = nBlock - nBlock % c->reset_blkcount;
+    int64_t b = nBlock;
+    while (b > first && !chain_get(c, b - 1, key)) {
+        b--;
     }
-
-    int res = lzx_decompress(h->lzx_state, buf, uncompressed, (int)cmpLen, (int)blockSize);
-    if (res != DECR_OK) {
-        dbgprintf("   (DECOMPRESS FAILED!)\n");
-        goto Error;
+    int64_t maxLen = c->block_len + 6144;
+    for (; b <= nBlock; b++) {
+        int64_t cmpStart, cmpLen;
+        if (!get_cmpblock_bounds(h, b, &cmpStart, &cmpLen) || cmpLen < 0 || cmpLen > maxLen) {
+            return false;
+        }
+        const uint8_t* cmp = reader_ptr(h, cmpStart, cmpLen);
+        if (cmp == NULL) {
+            if (s->cmp_buf == NULL) {
+                s->cmp_buf = (uint8_t*)chm_alloc((size_t)maxLen);
+                if (s->cmp_buf == NULL) {
+                    return false;
+                }
+            }
+            if (read_bytes(h, s->cmp_buf, cmpStart, cmpLen) != cmpLen) {
+                return false;
+            }
+            cmp = s->cmp_buf;
+        }
+        chain_extend(h, b, cmp, cmpLen);
     }
-
-    h->lzx_last_block = (int)nBlock;
-    h->lzx_last_block_data = uncompressed;
-    free(buf);
-    return uncompressed;
-Error:
-    free(buf);
-    return NULL;
+    return chain_get(c, nBlock, key);
 }
 
-static int64_t decompress_block(chm_file* h, int64_t nBlock, uint8_t** ubuffer) {
-    uint32_t blockAlign = ((uint32_t)nBlock % h->reset_blkcount); /* reset intvl. aln. */
-
-    /* let the caching system pull its weight! */
-    if (nBlock - blockAlign <= h->lzx_last_block && nBlock >= h->lzx_last_block)
-        blockAlign = (uint32_t)(nBlock - h->lzx_last_block);
-
-    /* check if we need previous blocks */
-    if (blockAlign != 0) {
-        /* fetch all required previous blocks since last reset */
-        for (uint32_t i = blockAlign; i > 0; i--) {
-            uint8_t* d = uncompress_block(h, nBlock - i);
-            if (!d) {
-                return 0;
-            }
-        }
+/* block nBlock from another chm_file with the same content, put in this file's
+ * cache, with a reference the caller must release. NULL if there's none */
+static cache_block* dedup_get(chm_session* s, int64_t nBlock, bool mayRead) {
+    chm_cache* c = s->h->cache;
+    if (c->chain == NULL || nBlock < 0 || nBlock >= c->n_chain || !dedup_enabled()) {
+        return NULL;
     }
-    *ubuffer = uncompress_block(h, nBlock);
-    if (!*ubuffer) {
-        return 0;
+    dedup_key key;
+    if (!block_key(s, nBlock, mayRead, &key)) {
+        return NULL;
     }
-
-    /* XXX: modify LZX routines to return the length of the data they
-     * decompressed and return that instead, for an extra sanity check.
-     */
-    return h->reset_table.block_len;
+    cache_block* src = dedup_find(&key);
+    if (src == NULL) {
+        return NULL;
+    }
+    cache_block* b = cache_block_alias(src, nBlock);
+    if (b == NULL) {
+        return NULL;
+    }
+    atomic_add64(&c->n_dedup_hits, 1);
+    cache_put(c, b);
+    return b;
 }
 
-/* grab a region from a compressed block */
-static int64_t decompress_region(chm_file* h, uint8_t* buf, int64_t start, int64_t len) {
-    uint8_t* ubuffer;
+/* make the freshly decompressed block b available to other chm_files */
+static void dedup_put(chm_file* h, cache_block* b) {
+    chm_cache* c = h->cache;
+    dedup_key key;
+    if (c->chain == NULL || b->index >= c->n_chain || !dedup_enabled() ||
+        !chain_get(c, b->index, &key)) {
+        return;
+    }
+    dedup_insert(&key, b, c->block_len);
+}
 
-    if (len <= 0)
+/* compressed data of the blocks first_block..end_block - 1, which are
+ * contiguous in the file */
+typedef struct ra_buffer {
+    uint8_t* data;
+    int64_t first_block;
+    int64_t end_block;
+    int64_t off;
+    int64_t len;
+    /* false until the read finished successfully */
+    bool ok;
+} ra_buffer;
+
+/* Read-ahead for sessions that decompress blocks in order. The decoder works
+ * from cur while a background thread reads the compressed data of the blocks
+ * that follow into next. */
+struct readahead {
+    chm_file* h;
+    int n_blocks;
+    /* allocated size of the buffers is buf_len plus room for the decoder to read
+     * past the end of the last block */
+    int64_t buf_len;
+    ra_buffer cur;
+    ra_buffer next;
+
+    chm_mutex mutex;
+    chm_cond cond;
+    chm_thread thread;
+    bool thread_started;
+    /* next is being read */
+    bool pending;
+    bool stop;
+};
+
+/* set up b to read up to n blocks starting with first. Returns false past the last block */
+static bool ra_prepare(readahead* ra, ra_buffer* b, int64_t first, int n) {
+    chm_file* h = ra->h;
+    int64_t n_blocks = (int64_t)h->reset_table.block_count;
+    if (first >= n_blocks) {
+        return false;
+    }
+    if (n > n_blocks - first) {
+        n = (int)(n_blocks - first);
+    }
+    int64_t start, len, lastStart = 0, lastLen = 0;
+    if (!get_cmpblock_bounds(h, first, &start, &len)) {
+        return false;
+    }
+    /* fewer blocks if they're larger than expected */
+    for (; n > 1; n /= 2) {
+        if (get_cmpblock_bounds(h, first + n - 1, &lastStart, &lastLen) && lastStart >= start &&
+            lastStart + lastLen - start <= ra->buf_len) {
+            break;
+        }
+    }
+    if (n == 1) {
+        lastStart = start;
+        lastLen = len;
+    }
+    if (len < 0 || lastStart + lastLen - start > ra->buf_len) {
+        return false;
+    }
+    b->first_block = first;
+    b->end_block = first + n;
+    b->off = start;
+    b->len = lastStart + lastLen - start;
+    b->ok = false;
+    return true;
+}
+
+static void ra_read(readahead* ra, ra_buffer* b) {
+    b->ok = read_bytes(ra->h, b->data, b->off, b->len) == b->len;
+}
+
+static bool ra_covers(ra_buffer* b, int64_t nBlock, int64_t cmpStart, int64_t cmpLen) {
+    return b->ok && nBlock >= b->first_block && nBlock < b->end_block && cmpStart >= b->off &&
+           cmpStart + cmpLen <= b->off + b->len;
+}
+
+static void readahead_thread(void* arg) {
+    readahead* ra = (readahead*)arg;
+    mutex_lock(&ra->mutex);
+    while (!ra->stop) {
+        if (!ra->pending) {
+            cond_wait(&ra->cond, &ra->mutex);
+            continue;
+        }
+        mutex_unlock(&ra->mutex);
+        ra_read(ra, &ra->next);
+        mutex_lock(&ra->mutex);
+        ra->pending = false;
+        cond_broadcast(&ra->cond);
+    }
+    mutex_unlock(&ra->mutex);
+}
+
+static readahead* readahead_new(chm_file* h, int nBlocks) {
+    readahead* ra = (readahead*)chm_calloc(1, sizeof(readahead));
+    if (ra == NULL) {
+        return NULL;
+    }
+    int64_t maxCmpLen = h->reset_table.block_len + 6144;
+    ra->h = h;
+    ra->n_blocks = nBlocks;
+    ra->buf_len = nBlocks * maxCmpLen;
+    ra->cur.data = (uint8_t*)chm_alloc((size_t)(ra->buf_len + maxCmpLen));
+    ra->next.data = (uint8_t*)chm_alloc((size_t)(ra->buf_len + maxCmpLen));
+    if (ra->cur.data == NULL || ra->next.data == NULL) {
+        chm_free(ra->cur.data);
+        chm_free(ra->next.data);
+        chm_free(ra);
+        return NULL;
+    }
+    mutex_init(&ra->mutex);
+    cond_init(&ra->cond);
+    return ra;
+}
+
+static void readahead_free(readahead* ra) {
+    if (ra == NULL) {
+        return;
+    }
+    if (ra->thread_started) {
+        mutex_lock(&ra->mutex);
+        ra->stop = true;
+        cond_broadcast(&ra->cond);
+        mutex_unlock(&ra->mutex);
+        thread_join(ra->thread);
+    }
+    cond_destroy(&ra->cond);
+    mutex_destroy(&ra->mutex);
+    chm_free(ra->cur.data);
+    chm_free(ra->next.data);
+    chm_free(ra);
+}
+
+/* the compressed data of block nBlock from the read-ahead buffers, reading
+ * it and the blocks after it if it isn't there yet */
+static uint8_t* readahead_get(readahead* ra, int64_t nBlock, int64_t cmpStart, int64_t cmpLen) {
+    if (!ra_covers(&ra->cur, nBlock, cmpStart, cmpLen)) {
+        mutex_lock(&ra->mutex);
+        while (ra->pending) {
+            cond_wait(&ra->cond, &ra->mutex);
+        }
+        mutex_unlock(&ra->mutex);
+
+        if (ra_covers(&ra->next, nBlock, cmpStart, cmpLen)) {
+            ra_buffer tmp = ra->cur;
+            ra->cur = ra->next;
+            ra->next = tmp;
+            ra->next.ok = false;
+        } else {
+            if (!ra_prepare(ra, &ra->cur, nBlock, ra->n_blocks)) {
+                return NULL;
+            }
+            ra_read(ra, &ra->cur);
+            if (!ra_covers(&ra->cur, nBlock, cmpStart, cmpLen)) {
+                return NULL;
+            }
+        }
+
+        /* start reading the blocks after cur */
+        if (!ra->thread_started) {
+            ra->thread_started = thread_start(&ra->thread, readahead_thread, ra);
+        }
+        if (ra->thread_started && ra_prepare(ra, &ra->next, ra->cur.end_block, ra->n_blocks)) {
+            mutex_lock(&ra->mutex);
+            ra->pending = true;
+            cond_broadcast(&ra->cond);
+            mutex_unlock(&ra->mutex);
+        }
+    }
+    return ra->cur.data + (cmpStart - ra->cur.off);
+}
+
+bool chm_session_set_readahead(chm_session* s, int nBlocks) {
+    if (s == NULL) {
+        return false;
+    }
+    readahead_free(s->ra);
+    s->ra = NULL;
+    if (nBlocks <= 0 || !s->h->compression_enabled) {
+        return true;
+    }
+    s->ra = readahead_new(s->h, nBlocks);
+    return s->ra != NULL;
+}
+
+/* decompress block nBlock into out, from the cmpLen bytes at cmp or, if cmp is
+ * NULL, from data read with the session. The session's decompressor must have
+ * just decompressed block nBlock - 1, unless nBlock is a reset point */
+static bool decode_block(chm_session* s, int64_t nBlock, uint8_t* cmp, int64_t cmpLen,
+                         uint8_t* out) {
+    chm_file* h = s->h;
+    size_t blockSize = (size_t)h->reset_table.block_len;
+
+    if (nBlock % h->reset_blkcount == 0) {
+        lzx_reset(s->lzx_state);
+    }
+
+    dbgprintf("Decompressing block #%4d (EXTRA)\n", nBlock);
+    int64_t cmpStart = 0;
+    if (cmp == NULL && !get_cmpblock_bounds(h, nBlock, &cmpStart, &cmpLen)) {
+        return false;
+    }
+    if (cmpLen < 0 || cmpLen > (int64_t)blockSize + 6144) {
+        return false;
+    }
+
+    uint8_t* buf = cmp;
+    if (buf == NULL) {
+        /* read ahead only once the blocks are being decoded in order */
+        s->n_sequential = (nBlock == s->last_decoded + 1) ? s->n_sequential + 1 : 0;
+        s->last_decoded = nBlock;
+
+        /* the decoder can read past the end of its input, so it can only work on the
+         * reader's memory if there's enough of it after the block */
+        buf = (uint8_t*)reader_ptr(h, cmpStart, (int64_t)blockSize + 6144);
+    }
+    if (buf == NULL && s->ra != NULL && s->n_sequential >= 2) {
+        buf = readahead_get(s->ra, nBlock, cmpStart, cmpLen);
+    }
+    if (buf == NULL) {
+        if (s->cmp_buf == NULL) {
+            s->cmp_buf = (uint8_t*)chm_alloc(blockSize + 6144);
+            if (s->cmp_buf == NULL) {
+                return false;
+            }
+        }
+        buf = s->cmp_buf;
+        if (read_bytes(h, buf, cmpStart, cmpLen) != cmpLen) {
+            return false;
+        }
+    }
+
+    chain_extend(h, nBlock, buf, cmpLen);
+
+    int64_t start = now_ns();
+    int res = lzx_decompress(s->lzx_state, buf, out, (int)cmpLen, (int)blockSize);
+    int64_t ns = now_ns() - start;
+    atomic_add64(&h->cache->n_decoded, 1);
+    atomic_add64(&h->cache->decode_ns, ns);
+    if (h->cache->event_func) {
+        report_event(h->cache, CHM_EVENT_DECODE, nBlock, (int64_t)blockSize, ns);
+    }
+    if (res != DECR_OK) {
+        dbgprintf("   (DECOMPRESS FAILED!)\n");
+        return false;
+    }
+    checkpoint_save(h->cache, nBlock + 1, s->lzx_state);
+    return true;
+}
+
+/* decompress block nBlock, see decode_block() for cmp and cmpLen, and make it the
+ * session's last block. Returns the block, owned by the session until the next call */
+static cache_block* uncompress_block(chm_session* s, int64_t nBlock, uint8_t* cmp,
+                                     int64_t cmpLen) {
+    chm_file* h = s->h;
+
+    if (s->lzx_last_block != NULL && s->lzx_last_block->index == nBlock) {
+        return s->lzx_last_block;
+    }
+
+    cache_block* uncompressed = cache_block_new(h, nBlock);
+    if (!uncompressed || !decode_block(s, nBlock, cmp, cmpLen, uncompressed->data)) {
+        goto Error;
+    }
+
+    cache_put(h->cache, uncompressed);
+    dedup_put(h, uncompressed);
+    cache_block_release(s->lzx_last_block);
+    s->lzx_last_block = uncompressed;
+    return uncompressed;
+Error:
+    /* the decompressor state is unusable, restart from a reset point next time */
+    cache_block_release(uncompressed);
+    cache_block_release(s->lzx_last_block);
+    s->lzx_last_block = NULL;
+    return NULL;
+}
+
+/* the first block to decompress on the way to block nBlock: the reset point
+ * before it, the session's last block or the block after a checkpoint, which is
+ * then restored into the session's decompressor */
+static int64_t decode_start(chm_session* s, int64_t nBlock) {
+    chm_file* h = s->h;
+    uint32_t blockAlign = ((uint32_t)nBlock % h->reset_blkcount); /* reset intvl. aln. */
+
+    /* let the caching system pull its weight! */
+    int64_t after = nBlock - blockAlign;
+    if (s->lzx_last_block != NULL) {
+        int64_t lastBlock = s->lzx_last_block->index;
+        if (nBlock - blockAlign <= lastBlock && nBlock >= lastBlock) {
+            blockAlign = (uint32_t)(nBlock - lastBlock);
+            after = lastBlock + 1;
+        }
+    }
+
+    /* or resume from a checkpoint if there's one closer */
+    if (blockAlign > 1) {
+        int64_t ckpt = checkpoint_restore(h->cache, after, nBlock, s->lzx_state);
+        if (ckpt >= 0) {
+            atomic_add64(&h->cache->n_ckpt_restores, 1);
+            cache_block_release(s->lzx_last_block);
+            s->lzx_last_block = NULL;
+            blockAlign = (uint32_t)(nBlock - ckpt);
+        }
+    }
+    return nBlock - blockAlign;
+}
+
+static cache_block* decompress_block(chm_session* s, int64_t nBlock) {
+    chm_file* h = s->h;
+
+    /* another archive may have decompressed the same block */
+    cache_block* shared = dedup_get(s, nBlock, true);
+    if (shared != NULL) {
+        cache_block_release(s->dedup_block);
+        s->dedup_block = shared;
+        return shared;
+    }
+
+    /* fetch all required previous blocks since last reset */
+    for (int64_t i = decode_start(s, nBlock); i < nBlock; i++) {
+        if (s->lzx_last_block == NULL || s->lzx_last_block->index != i) {
+            atomic_add64(&h->cache->n_redecoded, 1);
+        }
+        cache_block* d = uncompress_block(s, i, NULL, 0);
+        if (!d) {
+            return NULL;
+        }
+    }
+
+    /* XXX: modify LZX routines to return the length of the data they
+     * decompressed and check it, for an extra sanity check.
+     */
+    return uncompress_block(s, nBlock, NULL, 0);
+}
+
+static bool ensure_lzx_state(chm_session* s) {
+    if (!s->lzx_state) {
+        s->lzx_window = ffs((int)s->h->window_size) - 1;
+        s->lzx_state = lzx_pool_get(s->lzx_window);
+    }
+    return s->lzx_state != NULL;
+}
+
+/* grab a region from a compressed block */
+static int64_t decompress_region(chm_session* s, uint8_t* buf, int64_t start, int64_t len) {
+    chm_file* h = s->h;
+
+    if (len <= 0)
         return (int64_t)0;
 
     /* figure out what we need to read */
@@ -797,32 +2469,30 @@ static int64_t decompress_region(chm_file* h, uint8_t* buf, int64_t start, int64
     if (nLen > (h->reset_table.block_len - nOffset))
         nLen = h->reset_table.block_len - nOffset;
 
-    uint8_t* cached_block = get_cached_block(h, nBlock);
+    cache_block* cached_block = cache_get(h->cache, nBlock);
     if (cached_block != NULL) {
-        memcpy(buf, cached_block + nOffset, (size_t)nLen);
+        memcpy(buf, cached_block->data + nOffset, (size_t)nLen);
+        cache_block_release(cached_block);
         return nLen;
     }
 
-    if (!h->lzx_state) {
-        int window_size = ffs((int)h->window_size) - 1;
-        h->lzx_last_block = -1;
-        h->lzx_state = lzx_init(window_size);
+    if (!ensure_lzx_state(s)) {
+        return 0;
     }
 
-    int64_t gotLen = decompress_block(h, nBlock, &ubuffer);
-    if (gotLen == (int64_t)-1) {
+    cache_block* ubuffer = decompress_block(s, nBlock);
+    if (!ubuffer) {
         return 0;
     }
-    if (gotLen < nLen)
-        nLen = gotLen;
-    memcpy(buf, ubuffer + nOffset, (unsigned int)nLen);
+    memcpy(buf, ubuffer->data + nOffset, (unsigned int)nLen);
     return nLen;
 }
 
-int64_t chm_retrieve_entry(chm_file* h, chm_entry* e, unsigned char* buf, int64_t addr,
-                           int64_t len) {
-    if (h == NULL)
+int64_t chm_session_retrieve_entry(chm_session* s, chm_entry* e, unsigned char* buf, int64_t addr,
+                                   int64_t len) {
+    if (s == NULL)
         return (int64_t)0;
+    chm_file* h = s->h;
 
     /* starting address must be in correct range */
     if (addr >= e->length)
@@ -836,54 +2506,1031 @@ int64_t chm_retrieve_entry(chm_file* h, chm_entry* e, unsigned char* buf, int64_
         return read_bytes(h, buf, (int64_t)h->itsf.data_offset + (int64_t)e->start + (int64_t)addr,
                           len);
     }
-    if (e->space != CHM_COMPRESSED) {
-        return 0;
+    if (e->space != CHM_COMPRESSED) {
+        return 0;
+    }
+
+    int64_t swath = 0, total = 0;
+
+    /* if compression is not enabled for this file... */
+    if (!h->compression_enabled)
+        return total;
+
+    do {
+        swath = decompress_region(s, buf, e->start + addr, len);
+
+        if (swath == 0)
+            return total;
+
+        /* update stats */
+        total += swath;
+        len -= swath;
+        addr += swath;
+        buf += swath;
+
+    } while (len != 0);
+
+    return total;
+}
+
+/* size of the pieces uncompressed data is read in when the reader can't hand
+ * out pointers into the file */
+#define CHM_VIEW_BUF_LEN (64 * 1024)
+
+bool chm_retrieve_view(chm_session* s, chm_entry* e, int64_t addr, int64_t len, chm_view* v) {
+    memzero(v, sizeof(chm_view));
+    if (s == NULL || e == NULL || addr < 0 || len < 0) {
+        return false;
+    }
+    if (e->space != CHM_UNCOMPRESSED && e->space != CHM_COMPRESSED) {
+        return false;
+    }
+    if (e->space == CHM_COMPRESSED && !s->h->compression_enabled) {
+        return false;
+    }
+    if (addr > e->length) {
+        addr = e->length;
+    }
+    if (len > e->length - addr) {
+        len = e->length - addr;
+    }
+    v->session = s;
+    v->entry = e;
+    v->addr = addr;
+    v->end = addr + len;
+    return true;
+}
+
+static bool view_next_uncompressed(chm_view* v) {
+    chm_file* h = v->session->h;
+    int64_t off = (int64_t)h->itsf.data_offset + v->entry->start + v->addr;
+    int64_t len = v->end - v->addr;
+
+    const uint8_t* d = reader_ptr(h, off, len);
+    if (d != NULL) {
+        v->data = d;
+        v->len = len;
+        return true;
+    }
+
+    if (v->buf == NULL) {
+        v->buf = (uint8_t*)chm_alloc(CHM_VIEW_BUF_LEN);
+        if (v->buf == NULL) {
+            return false;
+        }
+    }
+    if (len > CHM_VIEW_BUF_LEN) {
+        len = CHM_VIEW_BUF_LEN;
+    }
+    int64_t n = read_bytes(h, v->buf, off, len);
+    if (n <= 0) {
+        return false;
+    }
+    v->data = v->buf;
+    v->len = n;
+    return true;
+}
+
+/* block nBlock from the cache or decompressed, with a reference to it that
+ * the caller releases */
+static cache_block* pin_block(chm_session* s, int64_t nBlock) {
+    cache_block* b = cache_get(s->h->cache, nBlock);
+    if (b == NULL) {
+        if (!ensure_lzx_state(s)) {
+            return NULL;
+        }
+        b = decompress_block(s, nBlock);
+        if (b == NULL) {
+            return NULL;
+        }
+        /* the session lets go of the block on the next decompression, pin it */
+        atomic_inc(&b->refs);
+    }
+    return b;
+}
+
+static bool view_next_compressed(chm_view* v) {
+    chm_session* s = v->session;
+    chm_file* h = s->h;
+    int64_t start = v->entry->start + v->addr;
+    int64_t nBlock = start / h->reset_table.block_len;
+    int64_t nOffset = start % h->reset_table.block_len;
+    int64_t nLen = v->end - v->addr;
+    if (nLen > h->reset_table.block_len - nOffset) {
+        nLen = h->reset_table.block_len - nOffset;
+    }
+
+    cache_block* b = pin_block(s, nBlock);
+    if (b == NULL) {
+        return false;
+    }
+    v->pinned = b;
+    v->data = b->data + nOffset;
+    v->len = nLen;
+    return true;
+}
+
+bool chm_view_next(chm_view* v) {
+    cache_block_release((cache_block*)v->pinned);
+    v->pinned = NULL;
+    v->data = NULL;
+    v->len = 0;
+    if (v->session == NULL || v->addr >= v->end) {
+        return false;
+    }
+
+    bool ok;
+    if (v->entry->space == CHM_UNCOMPRESSED) {
+        ok = view_next_uncompressed(v);
+    } else {
+        ok = view_next_compressed(v);
+    }
+    if (!ok) {
+        /* stop here, addr tells how far we got */
+        v->end = v->addr;
+        v->failed = true;
+        return false;
+    }
+    v->addr += v->len;
+    return true;
+}
+
+void chm_view_close(chm_view* v) {
+    cache_block_release((cache_block*)v->pinned);
+    v->pinned = NULL;
+    chm_free(v->buf);
+    v->buf = NULL;
+    v->session = NULL;
+}
+
+/* states of chm_async, the ASYNC_READ_* ones wait for the data they're named after */
+enum {
+    ASYNC_RUN,
+    ASYNC_READ_DATA,
+    ASYNC_READ_RESET_TABLE,
+    ASYNC_READ_BLOCK,
+    ASYNC_DONE,
+    ASYNC_FAILED
+};
+
+bool chm_async_start(chm_async* a, chm_session* s, chm_entry* e, unsigned char* buf,
+                     int64_t addr, int64_t len) {
+    memzero(a, sizeof(chm_async));
+    a->state = ASYNC_FAILED;
+    if (s == NULL || e == NULL || addr < 0 || len < 0) {
+        return false;
+    }
+    if (e->space != CHM_UNCOMPRESSED && e->space != CHM_COMPRESSED) {
+        return false;
+    }
+    if (e->space == CHM_COMPRESSED && !s->h->compression_enabled) {
+        return false;
+    }
+    if (addr > e->length) {
+        addr = e->length;
+    }
+    if (len > e->length - addr) {
+        len = e->length - addr;
+    }
+    a->session = s;
+    a->entry = e;
+    a->buf = buf;
+    a->addr = addr;
+    a->len = len;
+    a->state = ASYNC_RUN;
+    a->decode = -1;
+    return true;
+}
+
+void chm_async_feed(chm_async* a, int64_t n) {
+    if (a->state == ASYNC_READ_DATA || a->state == ASYNC_READ_RESET_TABLE ||
+        a->state == ASYNC_READ_BLOCK) {
+        a->fed = n < 0 ? 0 : (n > a->read_len ? a->read_len : n);
+    }
+}
+
+static chm_async_status async_read(chm_async* a, int state, uint8_t* buf, int64_t off,
+                                   int64_t len) {
+    a->state = state;
+    a->read_buf = buf;
+    a->read_off = off;
+    a->read_len = len;
+    a->fed = -1;
+    return CHM_ASYNC_NEED_READ;
+}
+
+static chm_async_status async_end(chm_async* a, bool ok) {
+    a->state = ok ? ASYNC_DONE : ASYNC_FAILED;
+    a->read_buf = NULL;
+    a->read_len = 0;
+    return ok ? CHM_ASYNC_DONE : CHM_ASYNC_FAILED;
+}
+
+/* decompress block a->decode from cmp, counting it as redecoded like
+ * decompress_block() does if it's only needed to get to a->block */
+static bool async_decode(chm_async* a, uint8_t* cmp) {
+    chm_session* s = a->session;
+    if (a->decode < a->block) {
+        atomic_add64(&s->h->cache->n_redecoded, 1);
+    }
+    bool ok = uncompress_block(s, a->decode, cmp, a->cmp_len) != NULL;
+    a->decode++;
+    a->have_bounds = false;
+    return ok;
+}
+
+/* use the data the last read was for */
+static bool async_fed(chm_async* a) {
+    chm_file* h = a->session->h;
+    if (a->fed <= 0) {
+        return false;
+    }
+    if (a->state == ASYNC_READ_DATA) {
+        a->n_read += a->fed;
+        return true;
+    }
+    if (a->fed != a->read_len) {
+        return false;
+    }
+    if (a->state == ASYNC_READ_RESET_TABLE) {
+        unmarshaller u;
+        unmarshaller_init(&u, a->rt_buf, (int)a->read_len);
+        int64_t entry = get_int64(&u);
+        int64_t next = a->read_len == 16 ? get_int64(&u) : 0;
+        if (!u.ok) {
+            return false;
+        }
+        cmpblock_bounds(h, a->decode, entry, next, &a->cmp_start, &a->cmp_len);
+        a->have_bounds = true;
+        return true;
+    }
+    return async_decode(a, a->session->cmp_buf);
+}
+
+static chm_async_status async_step_uncompressed(chm_async* a) {
+    chm_file* h = a->session->h;
+    int64_t off = (int64_t)h->itsf.data_offset + a->entry->start + a->addr + a->n_read;
+    int64_t len = a->len - a->n_read;
+    if (len == 0) {
+        return async_end(a, true);
+    }
+    const uint8_t* d = reader_ptr(h, off, len);
+    if (d != NULL) {
+        memcpy(a->buf + a->n_read, d, (size_t)len);
+        a->n_read += len;
+        return async_end(a, true);
+    }
+    return async_read(a, ASYNC_READ_DATA, a->buf + a->n_read, off, len);
+}
+
+/* find the bounds of compressed block a->decode, or ask for its reset table
+ * entries if chm_parse() didn't preload them */
+static chm_async_status async_cmpblock_bounds(chm_async* a) {
+    chm_file* h = a->session->h;
+    int64_t block = a->decode;
+    bool last = is_last_cmpblock(h, block);
+    if (block + (last ? 0 : 1) < h->n_reset_offsets) {
+        if (!get_cmpblock_bounds(h, block, &a->cmp_start, &a->cmp_len)) {
+            return async_end(a, false);
+        }
+        a->have_bounds = true;
+        return CHM_ASYNC_DONE;
+    }
+    int64_t off = reset_table_entries_off(h) + block * 8;
+    return async_read(a, ASYNC_READ_RESET_TABLE, a->rt_buf, off, last ? 8 : 16);
+}
+
+static chm_async_status async_step_compressed(chm_async* a) {
+    chm_session* s = a->session;
+    chm_file* h = s->h;
+    int64_t blockSize = h->reset_table.block_len;
+    while (a->n_read < a->len) {
+        int64_t start = a->entry->start + a->addr + a->n_read;
+        int64_t nBlock = start / blockSize;
+        int64_t nOffset = start % blockSize;
+        int64_t nLen = a->len - a->n_read;
+        if (nLen > blockSize - nOffset) {
+            nLen = blockSize - nOffset;
+        }
+
+        cache_block* b = NULL;
+        if (a->decode < 0) {
+            b = cache_get(h->cache, nBlock);
+            if (b == NULL) {
+                /* only if it doesn't need reads to find the block's key */
+                b = dedup_get(s, nBlock, false);
+            }
+            if (b == NULL) {
+                if (!ensure_lzx_state(s)) {
+                    return async_end(a, false);
+                }
+                a->block = nBlock;
+                a->decode = decode_start(s, nBlock);
+            }
+        }
+        while (b == NULL && a->decode <= nBlock) {
+            if (s->lzx_last_block != NULL && s->lzx_last_block->index == a->decode) {
+                a->decode++;
+                continue;
+            }
+            if (!a->have_bounds) {
+                chm_async_status st = async_cmpblock_bounds(a);
+                if (st != CHM_ASYNC_DONE) {
+                    return st;
+                }
+            }
+            if (a->cmp_len < 0 || a->cmp_len > blockSize + 6144) {
+                return async_end(a, false);
+            }
+            /* see decode_block() for why it needs more than the block */
+            uint8_t* cmp = (uint8_t*)reader_ptr(h, a->cmp_start, blockSize + 6144);
+            if (cmp == NULL) {
+                if (s->cmp_buf == NULL) {
+                    s->cmp_buf = (uint8_t*)chm_alloc((size_t)blockSize + 6144);
+                    if (s->cmp_buf == NULL) {
+                        return async_end(a, false);
+                    }
+                }
+                return async_read(a, ASYNC_READ_BLOCK, s->cmp_buf, a->cmp_start, a->cmp_len);
+            }
+            if (!async_decode(a, cmp)) {
+                return async_end(a, false);
+            }
+        }
+
+        if (b != NULL) {
+            memcpy(a->buf + a->n_read, b->data + nOffset, (size_t)nLen);
+            cache_block_release(b);
+        } else {
+            /* decompressed on the way here, and the session holds on to it */
+            memcpy(a->buf + a->n_read, s->lzx_last_block->data + nOffset, (size_t)nLen);
+            a->decode = -1;
+        }
+        a->n_read += nLen;
+    }
+    return async_end(a, true);
+}
+
+chm_async_status chm_async_step(chm_async* a) {
+    if (a->state == ASYNC_DONE) {
+        return CHM_ASYNC_DONE;
+    }
+    if (a->state == ASYNC_FAILED) {
+        return CHM_ASYNC_FAILED;
+    }
+    if (a->state != ASYNC_RUN) {
+        if (a->fed < 0) {
+            /* still waiting for the read */
+            return CHM_ASYNC_NEED_READ;
+        }
+        bool ok = async_fed(a);
+        a->state = ASYNC_RUN;
+        if (!ok) {
+            return async_end(a, false);
+        }
+    }
+    if (a->entry->space == CHM_UNCOMPRESSED) {
+        return async_step_uncompressed(a);
+    }
+    return async_step_compressed(a);
+}
+
+static int cmp_entry_pos(const void* a, const void* b) {
+    const chm_entry* e1 = *(const chm_entry* const*)a;
+    const chm_entry* e2 = *(const chm_entry* const*)b;
+    if (e1->space != e2->space) {
+        return e1->space < e2->space ? -1 : 1;
+    }
+    if (e1->start != e2->start) {
+        return e1->start < e2->start ? -1 : 1;
+    }
+    if (e1->length != e2->length) {
+        return e1->length < e2->length ? -1 : 1;
+    }
+    /* keep directory order for identical ranges */
+    return e1 < e2 ? -1 : (e1 > e2 ? 1 : 0);
+}
+
+/* entries ordered by where their data is, so that the compressed stream is
+ * decoded front to back */
+static chm_entry** sort_entries(chm_file* h) {
+    int n = h->n_entries;
+    chm_entry** sorted = (chm_entry**)chm_alloc((size_t)n * sizeof(chm_entry*));
+    if (sorted == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        sorted[i] = &h->entries[i];
+    }
+    qsort(sorted, (size_t)n, sizeof(chm_entry*), cmp_entry_pos);
+    return sorted;
+}
+
+/* pass the data of e to f, reading it from addr with session s */
+static bool extract_entry(chm_session* s, chm_entry* e, int64_t addr, chm_extract_func f,
+                          void* ctx) {
+    if (e->length == 0) {
+        return f(ctx, e, 0, (const uint8_t*)"", 0);
+    }
+    bool ok = true;
+    chm_view v;
+    if (chm_retrieve_view(s, e, addr, e->length - addr, &v)) {
+        while (ok && chm_view_next(&v)) {
+            ok = f(ctx, e, addr, v.data, v.len);
+            addr += v.len;
+        }
+        chm_view_close(&v);
+    }
+    if (ok && addr != e->length) {
+        ok = f(ctx, e, addr, NULL, 0);
+    }
+    return ok;
+}
+
+bool chm_extract_all(chm_file* h, chm_extract_func f, void* ctx) {
+    if (h == NULL || !chm_load_entries(h)) {
+        return false;
+    }
+    chm_entry** sorted = sort_entries(h);
+    chm_session* s = chm_session_new(h);
+    bool ok = sorted != NULL && s != NULL;
+    if (ok && reader_mem(h) == NULL) {
+        /* it's fine to go without when there's not enough memory */
+        chm_session_set_readahead(s, CHM_READAHEAD_BLOCKS);
+    }
+    /* entries are in stream order, so the session's decompressor only moves
+     * forward and each block is decoded once */
+    for (int i = 0; ok && i < h->n_entries; i++) {
+        ok = extract_entry(s, sorted[i], 0, f, ctx);
+    }
+    chm_session_free(s);
+    chm_free(sorted);
+    return ok;
+}
+
+/* a reset interval decoded by a worker of chm_extract_all_parallel() */
+typedef struct extract_slot {
+    int64_t interval;
+    bool done;
+    /* number of bytes decoded before the first failure */
+    int64_t n_good;
+    uint8_t* data;
+} extract_slot;
+
+/* Workers claim reset intervals in order and decode each into a slot, while
+ * the calling thread hands the slots' data to the callback in entry order.
+ * Interval i goes to slot i % n_slots and is only claimed once all intervals
+ * before i - n_slots + 1 have been handed out, which bounds memory use. */
+typedef struct parallel_extract {
+    chm_file* h;
+    chm_mutex mutex;
+    /* signalled when oldest moves or on stop */
+    chm_cond work_cond;
+    /* signalled when a slot is done */
+    chm_cond done_cond;
+    extract_slot* slots;
+    int n_slots;
+    int64_t interval_len;
+    int64_t n_blocks;
+    int64_t n_intervals;
+    /* next interval to claim and oldest interval still needed */
+    int64_t next;
+    int64_t oldest;
+    bool stop;
+} parallel_extract;
+
+static int64_t decode_interval(chm_session* s, parallel_extract* px, int64_t interval,
+                               uint8_t* out) {
+    int64_t blockLen = px->h->reset_table.block_len;
+    int64_t first = interval * px->h->reset_blkcount;
+    int64_t last = first + px->h->reset_blkcount;
+    if (last > px->n_blocks) {
+        last = px->n_blocks;
+    }
+    int64_t n = 0;
+    for (int64_t b = first; b < last; b++) {
+        if (!decode_block(s, b, NULL, 0, out + n)) {
+            break;
+        }
+        n += blockLen;
+    }
+    return n;
+}
+
+static void extract_worker(void* arg) {
+    parallel_extract* px = (parallel_extract*)arg;
+    chm_session* s = chm_session_new(px->h);
+    bool canDecode = s != NULL && ensure_lzx_state(s);
+
+    mutex_lock(&px->mutex);
+    for (;;) {
+        while (!px->stop && px->next < px->n_intervals && px->next >= px->oldest + px->n_slots) {
+            cond_wait(&px->work_cond, &px->mutex);
+        }
+        if (px->stop || px->next >= px->n_intervals) {
+            break;
+        }
+        int64_t interval = px->next++;
+        extract_slot* slot = &px->slots[interval % px->n_slots];
+        slot->interval = interval;
+        slot->done = false;
+        mutex_unlock(&px->mutex);
+
+        int64_t n = canDecode ? decode_interval(s, px, interval, slot->data) : 0;
+
+        mutex_lock(&px->mutex);
+        slot->n_good = n;
+        slot->done = true;
+        cond_broadcast(&px->done_cond);
+    }
+    mutex_unlock(&px->mutex);
+    chm_session_free(s);
+}
+
+/* let workers reuse the slots of intervals before interval */
+static void retire_intervals(parallel_extract* px, int64_t interval) {
+    mutex_lock(&px->mutex);
+    if (interval > px->oldest) {
+        px->oldest = interval;
+        cond_broadcast(&px->work_cond);
+    }
+    mutex_unlock(&px->mutex);
+}
+
+static bool extract_compressed_entry(parallel_extract* px, chm_session* s, chm_entry* e,
+                                     chm_extract_func f, void* ctx) {
+    if (e->length == 0) {
+        return f(ctx, e, 0, (const uint8_t*)"", 0);
+    }
+    /* later entries start at or after this one */
+    retire_intervals(px, e->start / px->interval_len);
+
+    int64_t addr = 0;
+    while (addr < e->length) {
+        int64_t pos = e->start + addr;
+        int64_t interval = pos / px->interval_len;
+        int64_t off = pos % px->interval_len;
+        if (interval >= px->n_intervals) {
+            break;
+        }
+        if (interval < px->oldest) {
+            /* an entry overlapping a long earlier one, its intervals are gone */
+            return extract_entry(s, e, addr, f, ctx);
+        }
+        /* entries longer than all slots together need the slots of their
+         * own earlier intervals */
+        retire_intervals(px, interval);
+
+        extract_slot* slot = &px->slots[interval % px->n_slots];
+        mutex_lock(&px->mutex);
+        while (slot->interval != interval || !slot->done) {
+            cond_wait(&px->done_cond, &px->mutex);
+        }
+        int64_t n_good = slot->n_good;
+        mutex_unlock(&px->mutex);
+
+        if (off >= n_good) {
+            break;
+        }
+        int64_t n = n_good - off;
+        if (n > e->length - addr) {
+            n = e->length - addr;
+        }
+        if (!f(ctx, e, addr, slot->data + off, n)) {
+            return false;
+        }
+        addr += n;
+    }
+    if (addr != e->length) {
+        return f(ctx, e, addr, NULL, 0);
+    }
+    return true;
+}
+
+bool chm_extract_all_parallel(chm_file* h, int n_threads, chm_extract_func f, void* ctx) {
+    if (h == NULL || n_threads <= 1 || !h->compression_enabled) {
+        return chm_extract_all(h, f, ctx);
+    }
+    if (!chm_load_entries(h)) {
+        return false;
+    }
+
+    parallel_extract px;
+    memzero(&px, sizeof(px));
+    px.h = h;
+    px.n_slots = n_threads * 2;
+    px.interval_len = h->reset_table.block_len * h->reset_blkcount;
+    px.n_blocks = (h->reset_table.uncompressed_len + h->reset_table.block_len - 1) /
+                  h->reset_table.block_len;
+    if (px.n_blocks > (int64_t)h->reset_table.block_count) {
+        px.n_blocks = (int64_t)h->reset_table.block_count;
+    }
+    px.n_intervals = (px.n_blocks + h->reset_blkcount - 1) / h->reset_blkcount;
+    mutex_init(&px.mutex);
+    cond_init(&px.work_cond);
+    cond_init(&px.done_cond);
+
+    int n_started = 0;
+    chm_thread* threads = (chm_thread*)chm_alloc((size_t)n_threads * sizeof(chm_thread));
+    chm_entry** sorted = sort_entries(h);
+    chm_session* s = chm_session_new(h);
+    px.slots = (extract_slot*)chm_calloc((size_t)px.n_slots, sizeof(extract_slot));
+    bool ok = threads != NULL && sorted != NULL && s != NULL && px.slots != NULL;
+    for (int i = 0; ok && i < px.n_slots; i++) {
+        px.slots[i].interval = -1;
+        px.slots[i].data = (uint8_t*)chm_alloc((size_t)px.interval_len);
+        ok = px.slots[i].data != NULL;
+    }
+    for (int i = 0; ok && i < n_threads; i++) {
+        if (thread_start(&threads[n_started], extract_worker, &px)) {
+            n_started++;
+        }
+    }
+    /* without enough resources do it all on this thread */
+    bool fallback = !ok || n_started == 0;
+    if (fallback) {
+        goto Exit;
+    }
+
+    for (int i = 0; ok && i < h->n_entries; i++) {
+        chm_entry* e = sorted[i];
+        if (e->space == CHM_COMPRESSED) {
+            ok = extract_compressed_entry(&px, s, e, f, ctx);
+        } else {
+            ok = extract_entry(s, e, 0, f, ctx);
+        }
+    }
+
+Exit:
+    mutex_lock(&px.mutex);
+    px.stop = true;
+    cond_broadcast(&px.work_cond);
+    mutex_unlock(&px.mutex);
+    for (int i = 0; i < n_started; i++) {
+        thread_join(threads[i]);
+    }
+    for (int i = 0; px.slots != NULL && i < px.n_slots; i++) {
+        chm_free(px.slots[i].data);
+    }
+    chm_free(px.slots);
+    chm_session_free(s);
+    chm_free(sorted);
+    chm_free(threads);
+    cond_destroy(&px.done_cond);
+    cond_destroy(&px.work_cond);
+    mutex_destroy(&px.mutex);
+    if (fallback) {
+        return chm_extract_all(h, f, ctx);
+    }
+    return ok;
+}
+
+/* the part of a compressed request of chm_retrieve_batch() within one reset
+ * interval, start and end being positions in the decompressed stream */
+typedef struct batch_piece {
+    chm_retrieve_request* req;
+    int64_t interval;
+    int64_t start;
+    int64_t end;
+    /* bytes copied from start on before the first failure */
+    int64_t done;
+} batch_piece;
+
+typedef struct batch_retrieve {
+    chm_file* h;
+    batch_piece* pieces;
+    /* pieces of interval i are groups[i]..groups[i + 1] - 1 */
+    int64_t* groups;
+    int32_t n_groups;
+    /* next group to claim */
+    volatile int32_t next;
+} batch_retrieve;
+
+static int cmp_piece_pos(const void* a, const void* b) {
+    const batch_piece* p1 = (const batch_piece*)a;
+    const batch_piece* p2 = (const batch_piece*)b;
+    if (p1->interval != p2->interval) {
+        return p1->interval < p2->interval ? -1 : 1;
+    }
+    if (p1->start != p2->start) {
+        return p1->start < p2->start ? -1 : 1;
+    }
+    return p1->req < p2->req ? -1 : (p1->req > p2->req ? 1 : 0);
+}
+
+/* serve the pieces of one reset interval, ordered by start, going through the
+ * blocks they need front to back and copying each into every piece it overlaps */
+static void batch_sweep(chm_session* s, batch_piece* pieces, int64_t n, int64_t* active) {
+    int64_t blockLen = s->h->reset_table.block_len;
+    int64_t next = 0;
+    int64_t nActive = 0;
+    int64_t nBlock = 0;
+
+    while (next < n || nActive > 0) {
+        if (nActive == 0 && pieces[next].start / blockLen > nBlock) {
+            nBlock = pieces[next].start / blockLen;
+        }
+        int64_t blockStart = nBlock * blockLen;
+        int64_t blockEnd = blockStart + blockLen;
+        while (next < n && pieces[next].start < blockEnd) {
+            active[nActive++] = next++;
+        }
+
+        cache_block* b = pin_block(s, nBlock);
+        int64_t kept = 0;
+        for (int64_t i = 0; i < nActive; i++) {
+            batch_piece* p = &pieces[active[i]];
+            if (b == NULL) {
+                /* the piece ends here, done tells how far it got */
+                continue;
+            }
+            int64_t from = p->start + p->done;
+            int64_t to = p->end < blockEnd ? p->end : blockEnd;
+            memcpy(p->req->buf + (from - p->req->entry->start - p->req->addr),
+                   b->data + (from - blockStart), (size_t)(to - from));
+            p->done += to - from;
+            if (p->end > blockEnd) {
+                active[kept++] = active[i];
+            }
+        }
+        nActive = kept;
+        cache_block_release(b);
+        nBlock++;
+    }
+}
+
+static void batch_worker(void* arg) {
+    batch_retrieve* br = (batch_retrieve*)arg;
+    chm_session* s = chm_session_new(br->h);
+    int64_t* active = NULL;
+    int64_t activeCap = 0;
+
+    for (;;) {
+        int32_t g = atomic_inc(&br->next) - 1;
+        if (g >= br->n_groups) {
+            break;
+        }
+        int64_t first = br->groups[g];
+        int64_t n = br->groups[g + 1] - first;
+        if (n > activeCap) {
+            chm_free(active);
+            active = (int64_t*)chm_alloc((size_t)n * sizeof(int64_t));
+            activeCap = active != NULL ? n : 0;
+        }
+        /* without a session or memory the pieces stay unread */
+        if (s != NULL && active != NULL) {
+            batch_sweep(s, br->pieces + first, n, active);
+        }
+    }
+    chm_free(active);
+    chm_session_free(s);
+}
+
+/* the length of r after clipping it to its entry like chm_retrieve_entry() */
+static int64_t batch_len(chm_retrieve_request* r) {
+    chm_entry* e = r->entry;
+    if (r->addr < 0 || r->addr >= e->length || r->len <= 0) {
+        return 0;
+    }
+    return r->len < e->length - r->addr ? r->len : e->length - r->addr;
+}
+
+bool chm_retrieve_batch(chm_file* h, chm_retrieve_request* reqs, int n, int n_threads) {
+    if (h == NULL) {
+        return false;
+    }
+    int64_t intervalLen = h->reset_table.block_len * h->reset_blkcount;
+    bool canDecode = h->compression_enabled && intervalLen > 0;
+    int64_t nPieces = 0;
+    bool ok = true;
+
+    /* read the uncompressed requests and count the pieces of the compressed ones */
+    for (int i = 0; i < n; i++) {
+        chm_retrieve_request* r = &reqs[i];
+        chm_entry* e = r->entry;
+        int64_t len = batch_len(r);
+        r->n_read = 0;
+        if (len > 0 && e->space == CHM_UNCOMPRESSED) {
+            int64_t off = (int64_t)h->itsf.data_offset + e->start + r->addr;
+            int64_t got = read_bytes(h, r->buf, off, len);
+            r->n_read = got > 0 ? got : 0;
+        } else if (len > 0 && e->space == CHM_COMPRESSED && canDecode) {
+            int64_t start = e->start + r->addr;
+            nPieces += (start + len - 1) / intervalLen - start / intervalLen + 1;
+        }
+    }
+
+    batch_retrieve br;
+    memzero(&br, sizeof(br));
+    br.h = h;
+    br.pieces = (batch_piece*)chm_calloc((size_t)nPieces + 1, sizeof(batch_piece));
+    br.groups = (int64_t*)chm_alloc(((size_t)nPieces + 1) * sizeof(int64_t));
+    if (br.pieces == NULL || br.groups == NULL) {
+        goto Exit;
+    }
+
+    /* split the compressed requests at reset intervals, which can be decoded
+     * independently, and group the pieces by interval */
+    int64_t k = 0;
+    for (int i = 0; i < n && canDecode; i++) {
+        chm_retrieve_request* r = &reqs[i];
+        int64_t len = batch_len(r);
+        if (len == 0 || r->entry->space != CHM_COMPRESSED) {
+            continue;
+        }
+        int64_t pos = r->entry->start + r->addr;
+        int64_t end = pos + len;
+        while (pos < end) {
+            batch_piece* p = &br.pieces[k++];
+            int64_t intervalEnd = (pos / intervalLen + 1) * intervalLen;
+            p->req = r;
+            p->interval = pos / intervalLen;
+            p->start = pos;
+            p->end = intervalEnd < end ? intervalEnd : end;
+            pos = p->end;
+        }
+    }
+    qsort(br.pieces, (size_t)nPieces, sizeof(batch_piece), cmp_piece_pos);
+    for (int64_t i = 0; i < nPieces; i++) {
+        if (i == 0 || br.pieces[i].interval != br.pieces[i - 1].interval) {
+            br.groups[br.n_groups++] = i;
+        }
+    }
+    br.groups[br.n_groups] = nPieces;
+
+    /* the calling thread is one of the workers */
+    if (n_threads > br.n_groups) {
+        n_threads = br.n_groups;
+    }
+    int nStarted = 0;
+    chm_thread* threads = NULL;
+    if (n_threads > 1) {
+        threads = (chm_thread*)chm_alloc((size_t)(n_threads - 1) * sizeof(chm_thread));
+    }
+    for (int i = 0; threads != NULL && i < n_threads - 1; i++) {
+        if (thread_start(&threads[nStarted], batch_worker, &br)) {
+            nStarted++;
+        }
+    }
+    batch_worker(&br);
+    for (int i = 0; i < nStarted; i++) {
+        thread_join(threads[i]);
+    }
+    chm_free(threads);
+
+    /* a request was read up to its first piece that wasn't read completely.
+     * Its pieces come in interval order, so it stops growing there */
+    for (int64_t i = 0; i < nPieces; i++) {
+        batch_piece* p = &br.pieces[i];
+        chm_retrieve_request* r = p->req;
+        if (r->n_read == p->start - r->entry->start - r->addr) {
+            r->n_read += p->done;
+        }
+    }
+
+Exit:
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].n_read != batch_len(&reqs[i])) {
+            ok = false;
+        }
+    }
+    chm_free(br.groups);
+    chm_free(br.pieces);
+    return ok;
+}
+
+void chm_advise_sequential(chm_file* h) {
+    if (h == NULL || h->cn_unit == NULL) {
+        return;
+    }
+    int64_t off = (int64_t)h->itsf.data_offset + h->cn_unit->start;
+    int64_t len = h->cn_unit->length;
+#ifndef WIN32
+    mem_reader_ctx* ctx = reader_mem(h);
+    if (ctx != NULL && h->read_func == mmap_reader) {
+        if (off < 0 || off >= ctx->size) {
+            return;
+        }
+        if (len > ctx->size - off) {
+            len = ctx->size - off;
+        }
+        /* madvise() wants a page aligned address */
+        int64_t page = (int64_t)sysconf(_SC_PAGESIZE);
+        int64_t aligned = off - off % page;
+        uint8_t* d = (uint8_t*)ctx->data + aligned;
+        madvise(d, (size_t)(len + off - aligned), MADV_SEQUENTIAL);
+        madvise(d, (size_t)(len + off - aligned), MADV_WILLNEED);
+    } else if (h->read_func == fd_reader) {
+        int fd = ((fd_reader_ctx*)h->read_ctx)->fd;
+        posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_WILLNEED);
     }
+#else
+    (void)off;
+    (void)len;
+#endif
+}
 
-    int64_t swath = 0, total = 0;
-
-    /* if compression is not enabled for this file... */
-    if (!h->compression_enabled)
-        return total;
-
-    do {
-        swath = decompress_region(h, buf, e->start + addr, len);
+int64_t chm_retrieve_entry(chm_file* h, chm_entry* e, unsigned char* buf, int64_t addr,
+                           int64_t len) {
+    if (h == NULL)
+        return (int64_t)0;
+    return chm_session_retrieve_entry(h->session, e, buf, addr, len);
+}
 
-        if (swath == 0)
-            return total;
+/* upper bound for the length of the PMGL chain, so that loops in broken files terminate */
+static uint32_t max_dir_pages(chm_file* h) {
+    int64_t n = h->dir_len / h->itsp.block_len;
+    return n > (int64_t)h->itsp.num_blocks ? (uint32_t)n : h->itsp.num_blocks;
+}
 
-        /* update stats */
-        total += swath;
-        len -= swath;
-        addr += swath;
-        buf += swath;
+static bool read_dir_page(chm_file* h, uint8_t* buf, int32_t page) {
+    int64_t n = h->itsp.block_len;
+    return read_bytes(h, buf, (int64_t)h->dir_offset + (int64_t)page * n, n) == n;
+}
 
-    } while (len != 0);
+/* Pages of the directory are read many at a time when parsing all of it: it's
+ * contiguous, and the PMGL chain mostly goes through it in order, so this
+ * turns one read per page into a few large ones. */
+typedef struct dir_window {
+    uint8_t* buf;
+    int64_t first_page;
+    int64_t n_pages;
+    int64_t max_pages;
+} dir_window;
+
+static bool dir_window_init(chm_file* h, dir_window* w) {
+    w->first_page = 0;
+    w->n_pages = 0;
+    w->max_pages = CHM_DIR_READ_LEN / h->itsp.block_len;
+    int64_t dirPages = h->dir_len / h->itsp.block_len;
+    if (w->max_pages > dirPages) {
+        w->max_pages = dirPages;
+    }
+    if (w->max_pages < 1) {
+        w->max_pages = 1;
+    }
+    w->buf = NULL;
+    if (reader_mem(h) != NULL) {
+        /* pages are read in place */
+        return true;
+    }
+    w->buf = (uint8_t*)chm_alloc((size_t)(w->max_pages * h->itsp.block_len));
+    return w->buf != NULL;
+}
 
-    return total;
+static uint8_t* dir_window_page(chm_file* h, dir_window* w, int32_t page) {
+    int64_t blockLen = h->itsp.block_len;
+    int64_t off = (int64_t)h->dir_offset + (int64_t)page * blockLen;
+    if (w->buf == NULL) {
+        return (uint8_t*)reader_ptr(h, off, blockLen);
+    }
+    if (page < w->first_page || page >= w->first_page + w->n_pages) {
+        /* read from this page on, but not beyond the directory */
+        int64_t n = h->dir_len / blockLen - page;
+        if (n > w->max_pages) {
+            n = w->max_pages;
+        }
+        if (n < 1) {
+            n = 1;
+        }
+        int64_t got = read_bytes(h, w->buf, off, n * blockLen);
+        w->first_page = page;
+        w->n_pages = got > 0 ? got / blockLen : 0;
+        if (w->n_pages == 0) {
+            return NULL;
+        }
+    }
+    return w->buf + (page - w->first_page) * blockLen;
 }
 
+/* all entries live in one array and all their paths in one string pool, so
+ * a directory takes two allocations no matter how many entries it has */
 static bool parse_entries(chm_file* h) {
     pgml_hdr pgml;
+    char path[CHM_MAX_PATHLEN + 1];
 
     int n_entries = 0;
-    chm_entry* e;
-    chm_entry* last_entry = NULL;
-    uint8_t* buf = malloc((size_t)h->itsp.block_len);
-    if (buf == NULL) {
+    int entries_cap = 0;
+    chm_entry* entries = NULL;
+    size_t paths_len = 0;
+    size_t paths_cap = 0;
+    char* paths = NULL;
+    dir_window w;
+    if (!dir_window_init(h, &w)) {
         goto Error;
     }
 
     int32_t cur_page = h->itsp.index_head;
 
-    while (cur_page != -1) {
-        int64_t n = h->itsp.block_len;
-        if (read_bytes(h, buf, (int64_t)h->dir_offset + (int64_t)cur_page * n, n) != n) {
+    for (uint32_t i = 0; cur_page != -1 && i < max_dir_pages(h); i++) {
+        uint8_t* buf = cur_page >= 0 ? dir_window_page(h, &w, cur_page) : NULL;
+        if (buf == NULL) {
             goto Error;
         }
 
         unmarshaller u;
-        unmarshaller_init(&u, buf, (int)n);
+        unmarshaller_init(&u, buf, (int)h->itsp.block_len);
         if (!unmarshal_pmgl_header(&u, h->itsp.block_len, &pgml)) {
             goto Error;
         }
@@ -891,13 +3538,33 @@ static bool parse_entries(chm_file* h) {
 
         /* decode all entries in this page */
         while (u.bytesLeft > 0) {
-            e = parse_pmgl_entry(&u);
-            if (e == NULL) {
+            chm_entry e;
+            if (!parse_pmgl_entry(&u, &e, path)) {
                 goto Error;
             }
-            e->next = last_entry;
-            last_entry = e;
-            n_entries++;
+            size_t pathLen = strlen(path) + 1;
+            if (n_entries == entries_cap) {
+                int cap = entries_cap == 0 ? 256 : entries_cap * 2;
+                chm_entry* tmp =
+                    (chm_entry*)chm_realloc(entries, (size_t)cap * sizeof(chm_entry));
+                if (tmp == NULL) {
+                    goto Error;
+                }
+                entries = tmp;
+                entries_cap = cap;
+            }
+            if (paths_len + pathLen > paths_cap) {
+                size_t cap = paths_cap == 0 ? 16 * 1024 : paths_cap * 2;
+                char* tmp = (char*)chm_realloc(paths, cap);
+                if (tmp == NULL) {
+                    goto Error;
+                }
+                paths = tmp;
+                paths_cap = cap;
+            }
+            memcpy(paths + paths_len, path, pathLen);
+            paths_len += pathLen;
+            entries[n_entries++] = e;
         }
         cur_page = pgml.block_next;
     }
@@ -906,21 +3573,30 @@ static bool parse_entries(chm_file* h) {
     }
 
 Exit:
+    chm_free(w.buf);
     if (n_entries > 0) {
-        h->n_entries = n_entries;
-        chm_entry** entries = (chm_entry**)calloc((size_t)n_entries, sizeof(chm_entry*));
-        if (entries != NULL) {
-            h->entries = entries;
-            e = last_entry;
-            int n = n_entries - 1;
-            while (e != NULL) {
-                entries[n] = e;
-                --n;
-                e = e->next;
-            }
+        /* give back the unused part of both arrays */
+        chm_entry* tmp = (chm_entry*)chm_realloc(entries, (size_t)n_entries * sizeof(chm_entry));
+        if (tmp != NULL) {
+            entries = tmp;
+        }
+        char* tmp2 = (char*)chm_realloc(paths, paths_len);
+        if (tmp2 != NULL) {
+            paths = tmp2;
         }
+        /* paths are stored in entry order, one after the other */
+        char* p = paths;
+        for (int i = 0; i < n_entries; i++) {
+            entries[i].path = p;
+            p += strlen(p) + 1;
+        }
+        h->entries = entries;
+        h->n_entries = n_entries;
+        h->entry_paths = paths;
+    } else {
+        chm_free(entries);
+        chm_free(paths);
     }
-    free(buf);
     if (h->parse_entries_failed || n_entries == 0) {
         return false;
     }
@@ -930,6 +3606,239 @@ Error:
     goto Exit;
 }
 
+/* FNV-1a of the path with ASCII letters lower-cased, so that paths that only
+ * differ in case end up in the same hash chain */
+static uint32_t hash_path_nocase(const char* path) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = path; *c; c++) {
+        uint8_t b = (uint8_t)*c;
+        if (b >= 'A' && b <= 'Z') {
+            b += 'a' - 'A';
+        }
+        hash = (hash ^ b) * 16777619u;
+    }
+    return hash;
+}
+
+/* build an open-addressing hash table over the paths of all entries */
+static void build_path_index(chm_file* h) {
+    if (h->entries == NULL || h->n_entries == 0) {
+        return;
+    }
+    uint32_t n = 16;
+    while (n < (uint32_t)h->n_entries * 2) {
+        n <<= 1;
+    }
+    int32_t* slots = (int32_t*)chm_calloc(n, sizeof(int32_t));
+    if (slots == NULL) {
+        return;
+    }
+    uint32_t mask = n - 1;
+    for (int i = 0; i < h->n_entries; i++) {
+        uint32_t idx = hash_path_nocase(h->entries[i].path) & mask;
+        while (slots[idx] != 0) {
+            idx = (idx + 1) & mask;
+        }
+        /* 0 marks an empty slot */
+        slots[idx] = i + 1;
+    }
+    h->path_index = slots;
+    h->path_index_mask = mask;
+}
+
+static bool path_matches(const char* s1, const char* s2, bool ignoreCase) {
+    return ignoreCase ? streq(s1, s2) : strcmp(s1, s2) == 0;
+}
+
+/* walk down the PMGI index to the PMGL page that would contain path and read
+ * it into buf. Returns -1 if there's no such page. Without PMGI blocks the
+ * root is the first PMGL page and path might be in any page of the chain */
+static int32_t find_pmgl_page(chm_file* h, uint8_t* buf, const char* path, bool* unindexed) {
+    char name[CHM_MAX_PATHLEN + 1];
+    int32_t page = h->itsp.index_root;
+
+    for (int depth = 0; depth < CHM_MAX_INDEX_DEPTH; depth++) {
+        if (page < 0 || !read_dir_page(h, buf, page)) {
+            return -1;
+        }
+        if (memeq(buf, _chm_pmgl_marker, 4)) {
+            *unindexed = (depth == 0);
+            return page;
+        }
+        if (!memeq(buf, _chm_pmgi_marker, 4)) {
+            return -1;
+        }
+        unmarshaller u;
+        unmarshaller_init(&u, buf, (int)h->itsp.block_len);
+        eat_bytes(&u, 4);
+        uint32_t freeSpace = get_uint32(&u);
+        if (!u.ok || freeSpace > h->itsp.block_len - CHM_PMGI_LEN) {
+            return -1;
+        }
+        u.bytesLeft -= freeSpace;
+
+        /* entries are sorted, the child page is the one of the last entry <= path */
+        int32_t child = -1;
+        while (u.bytesLeft > 0) {
+            if (!get_entry_path(&u, name)) {
+                return -1;
+            }
+            if (strcasecmp(name, path) > 0) {
+                break;
+            }
+            child = (int32_t)get_cword(&u);
+            if (!u.ok) {
+                return -1;
+            }
+        }
+        page = child;
+    }
+    return -1;
+}
+
+/* find path in directory page buf and parse its entry into e, with the path
+ * read into name. next_page is set to the page following buf in the PMGL chain */
+static bool find_in_pmgl(chm_file* h, uint8_t* buf, const char* path, bool ignoreCase,
+                         chm_entry* e, char* name, int32_t* next_page) {
+    pgml_hdr pgml;
+    unmarshaller u;
+    unmarshaller_init(&u, buf, (int)h->itsp.block_len);
+    *next_page = -1;
+    if (!unmarshal_pmgl_header(&u, h->itsp.block_len, &pgml)) {
+        return false;
+    }
+    *next_page = pgml.block_next;
+    u.bytesLeft -= pgml.free_space;
+
+    while (u.bytesLeft > 0) {
+        if (!parse_pmgl_entry(&u, e, name)) {
+            return false;
+        }
+        if (path_matches(name, path, ignoreCase)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* find an entry without parsing the whole directory, for chm_parse_lazy() */
+static chm_entry* resolve_entry(chm_file* h, const char* path, bool ignoreCase) {
+    resolved_entry* head = atomic_load_entry(&h->resolved_entries);
+    for (resolved_entry* r = head; r != NULL; r = r->next) {
+        if (path_matches(r->e.path, path, ignoreCase)) {
+            return &r->e;
+        }
+    }
+
+    uint8_t* buf = (uint8_t*)chm_alloc((size_t)h->itsp.block_len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    char name[CHM_MAX_PATHLEN + 1];
+    chm_entry e;
+    bool found = false;
+    bool unindexed = false;
+    int32_t page = find_pmgl_page(h, buf, path, &unindexed);
+    for (uint32_t i = 0; page >= 0 && i < max_dir_pages(h); i++) {
+        found = find_in_pmgl(h, buf, path, ignoreCase, &e, name, &page);
+        if (found || !unindexed || page < 0 || !read_dir_page(h, buf, page)) {
+            break;
+        }
+    }
+    chm_free(buf);
+    if (!found) {
+        return NULL;
+    }
+
+    size_t pathLen = strlen(name) + 1;
+    resolved_entry* r = (resolved_entry*)chm_alloc(sizeof(resolved_entry) + pathLen);
+    if (r == NULL) {
+        return NULL;
+    }
+    memcpy(r->path, name, pathLen);
+    r->e = e;
+    r->e.path = r->path;
+
+    /* other threads might be resolving at the same time, so push without a lock.
+     * Two threads resolving the same path both add it, which is harmless */
+    do {
+        head = atomic_load_entry(&h->resolved_entries);
+        r->next = head;
+    } while (!atomic_cas_entry(&h->resolved_entries, head, r));
+    return &r->e;
+}
+
+static chm_entry* find_entry(chm_file* h, const char* path, bool ignoreCase) {
+    if (h->entries == NULL) {
+        return resolve_entry(h, path, ignoreCase);
+    }
+    if (h->path_index == NULL) {
+        /* building the index failed, fall back to a linear scan */
+        for (int i = 0; i < h->n_entries; i++) {
+            chm_entry* e = &h->entries[i];
+            if (path_matches(e->path, path, ignoreCase)) {
+                return e;
+            }
+        }
+        return NULL;
+    }
+    uint32_t mask = h->path_index_mask;
+    uint32_t idx = hash_path_nocase(path) & mask;
+    while (h->path_index[idx] != 0) {
+        chm_entry* e = &h->entries[h->path_index[idx] - 1];
+        if (path_matches(e->path, path, ignoreCase)) {
+            return e;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return NULL;
+}
+
+chm_entry* chm_find_entry(chm_file* h, const char* path) {
+    return find_entry(h, path, false);
+}
+
+chm_entry* chm_find_entry_nocase(chm_file* h, const char* path) {
+    return find_entry(h, path, true);
+}
+
+/* read the whole reset table with one read so that finding the bounds of a
+ * compressed block doesn't need any reads. Entries that can't be read (e.g.
+ * in truncated files) are read on demand by get_reset_table_entry() */
+static void load_reset_table_entries(chm_file* h) {
+    lzxc_reset_table* rt = &h->reset_table;
+    /* only blocks within uncompressed_len can be needed by valid entries */
+    int64_t n = (rt->uncompressed_len + rt->block_len - 1) / rt->block_len;
+    if (n > (int64_t)rt->block_count) {
+        n = (int64_t)rt->block_count;
+    }
+    if (n <= 0 || n > CHM_MAX_RESET_TABLE_ENTRIES) {
+        return;
+    }
+
+    uint8_t* buf = (uint8_t*)chm_alloc((size_t)n * 8);
+    int64_t* offsets = (int64_t*)chm_alloc((size_t)n * sizeof(int64_t));
+    if (buf == NULL || offsets == NULL) {
+        goto Exit;
+    }
+    int64_t nRead = read_bytes(h, buf, reset_table_entries_off(h), n * 8);
+    if (nRead <= 0) {
+        goto Exit;
+    }
+    n = nRead / 8;
+    unmarshaller u;
+    unmarshaller_init(&u, buf, (int)(n * 8));
+    for (int64_t i = 0; i < n; i++) {
+        offsets[i] = get_int64(&u);
+    }
+    h->reset_offsets = offsets;
+    h->n_reset_offsets = n;
+    offsets = NULL;
+Exit:
+    chm_free(buf);
+    chm_free(offsets);
+}
+
 static bool parse_lzxc_reset_table(chm_file* h) {
     /* read reset table info */
     if (!h->compression_enabled) {
@@ -947,31 +3856,95 @@ static bool parse_lzxc_reset_table(chm_file* h) {
         h->compression_enabled = false;
         return false;
     }
+    load_reset_table_entries(h);
     return true;
 }
 
-bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
-    unsigned char buf[256];
-    chm_entry* lzxc = NULL;
-    unmarshaller u;
+bool chm_load_entries(chm_file* h) {
+    if (h->entries == NULL && !h->parse_entries_failed) {
+        parse_entries(h);
+        build_path_index(h);
+    }
+    return h->n_entries > 0;
+}
 
+static bool init_handle(chm_file* h, chm_reader read_func, void* read_ctx) {
     memzero(h, sizeof(chm_file));
     h->read_func = read_func;
     h->read_ctx = read_ctx;
+    h->cache = cache_new();
+    h->session = chm_session_new(h);
+    return h->cache != NULL && h->session != NULL;
+}
 
-    /* read and verify header */
+/* files parsed while the dedup cache is on take part in it */
+static void init_chain(chm_file* h) {
+    chm_cache* c = h->cache;
+    lzxc_reset_table* rt = &h->reset_table;
+    if (!dedup_enabled() || c->chain != NULL || rt->block_len <= 0 || h->reset_blkcount == 0) {
+        return;
+    }
+    /* like load_reset_table_entries(), only blocks within uncompressed_len count */
+    int64_t n = (rt->uncompressed_len + rt->block_len - 1) / rt->block_len;
+    if (n > (int64_t)rt->block_count) {
+        n = (int64_t)rt->block_count;
+    }
+    if (n <= 0 || n > CHM_MAX_RESET_TABLE_ENTRIES) {
+        return;
+    }
+    c->chain = (dedup_key*)chm_alloc((size_t)n * sizeof(dedup_key));
+    c->chain_known = (uint8_t*)chm_calloc((size_t)n, 1);
+    if (c->chain == NULL || c->chain_known == NULL) {
+        chm_free(c->chain);
+        chm_free(c->chain_known);
+        c->chain = NULL;
+        c->chain_known = NULL;
+        return;
+    }
+    c->n_chain = n;
+    c->window_size = h->window_size;
+}
+
+/* size the cache once the LZX parameters are known */
+static void init_cache(chm_file* h) {
+    if (h->compression_enabled) {
+        h->cache->block_len = h->reset_table.block_len;
+        h->cache->reset_blkcount = h->reset_blkcount;
+        init_chain(h);
+    }
+    chm_set_cache_size(h, CHM_MAX_BLOCKS_CACHED);
+}
+
+static bool read_itsf_header(chm_file* h, itsf_hdr* hdr) {
+    uint8_t buf[CHM_ITSF_V3_LEN];
     int64_t n = CHM_ITSF_V3_LEN;
     if (read_bytes(h, buf, 0, n) != n) {
+        return false;
+    }
+    unmarshaller u;
+    unmarshaller_init(&u, buf, (int)n);
+    if (!unmarshal_itsf_header(&u, hdr)) {
+        dbgprintf("unmarshal_itsf_header() failed\n");
+        return false;
+    }
+    return true;
+}
+
+static bool parse(chm_file* h, chm_reader read_func, void* read_ctx, bool lazy) {
+    unsigned char buf[256];
+    chm_entry* lzxc = NULL;
+    unmarshaller u;
+
+    if (!init_handle(h, read_func, read_ctx)) {
         goto Error;
     }
 
-    unmarshaller_init(&u, (uint8_t*)buf, (int)n);
-    if (!unmarshal_itsf_header(&u, &h->itsf)) {
-        dbgprintf("unmarshal_itsf_header() failed\n");
+    /* read and verify header */
+    if (!read_itsf_header(h, &h->itsf)) {
         goto Error;
     }
 
-    n = CHM_ITSP_V1_LEN;
+    int64_t n = CHM_ITSP_V1_LEN;
     if (read_func(read_ctx, buf, (int64_t)h->itsf.dir_offset, n) != n) {
         goto Error;
     }
@@ -994,21 +3967,13 @@ bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
 
     h->compression_enabled = true;
 
-    parse_entries(h);
-    if (h->n_entries == 0) {
+    if (!lazy && !chm_load_entries(h)) {
         goto Error;
     }
 
-    for (int i = 0; i < h->n_entries; i++) {
-        chm_entry* e = h->entries[i];
-        if (streq(e->path, CHMU_RESET_TABLE)) {
-            h->rt_unit = e;
-        } else if (streq(e->path, CHMU_CONTENT)) {
-            h->cn_unit = e;
-        } else if (streq(e->path, CHMU_LZXC_CONTROLDATA)) {
-            lzxc = e;
-        }
-    }
+    h->rt_unit = chm_find_entry_nocase(h, CHMU_RESET_TABLE);
+    h->cn_unit = chm_find_entry_nocase(h, CHMU_CONTENT);
+    lzxc = chm_find_entry_nocase(h, CHMU_LZXC_CONTROLDATA);
     if (is_null_or_compressed(h->rt_unit) || is_null_or_compressed(h->cn_unit) ||
         is_null_or_compressed(lzxc)) {
         h->compression_enabled = false;
@@ -1033,10 +3998,276 @@ bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
             }
         }
     }
-    chm_set_cache_size(h, CHM_MAX_BLOCKS_CACHED);
+    init_cache(h);
+
+    return true;
+Error:
+    chm_close(h);
+    return false;
+}
+
+bool chm_parse(chm_file* h, chm_reader read_func, void* read_ctx) {
+    return parse(h, read_func, read_ctx, false);
+}
+
+bool chm_parse_lazy(chm_file* h, chm_reader read_func, void* read_ctx) {
+    return parse(h, read_func, read_ctx, true);
+}
+
+/* sidecar index, see chm_index_save(). Written in the native byte order and
+ * struct layout: it's a cache for the machine that wrote it, not an exchange
+ * format, and anything that doesn't match is simply rejected */
+#define CHM_INDEX_MAGIC "CHMINDEX"
+#define CHM_INDEX_VERSION 1
+#define CHM_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct index_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t itsf_size;
+    uint32_t itsp_size;
+    uint32_t reset_table_size;
+    uint32_t entry_size;
+
+    /* the archive this index was made from */
+    int64_t file_size;
+    int64_t mtime;
+    itsf_hdr itsf;
+
+    itsp_hdr itsp;
+    lzxc_reset_table reset_table;
+    uint32_t compression_enabled;
+    uint32_t window_size;
+    uint32_t reset_interval;
+    uint32_t reset_blkcount;
+    int32_t rt_unit;
+    int32_t cn_unit;
+    uint32_t parse_entries_failed;
+    int32_t n_entries;
+    uint32_t path_index_len;
+    uint32_t unused;
+    int64_t n_reset_offsets;
+    int64_t paths_len;
+} index_hdr;
+
+typedef struct index_entry {
+    int64_t start;
+    int64_t length;
+    int64_t path_off;
+    int32_t space;
+    int32_t flags;
+} index_entry;
+
+static void index_hdr_init(index_hdr* hdr, int64_t file_size, int64_t mtime) {
+    memzero(hdr, sizeof(index_hdr));
+    memcpy(hdr->magic, CHM_INDEX_MAGIC, sizeof(hdr->magic));
+    hdr->version = CHM_INDEX_VERSION;
+    hdr->byte_order = CHM_INDEX_BYTE_ORDER;
+    hdr->itsf_size = sizeof(itsf_hdr);
+    hdr->itsp_size = sizeof(itsp_hdr);
+    hdr->reset_table_size = sizeof(lzxc_reset_table);
+    hdr->entry_size = sizeof(index_entry);
+    hdr->file_size = file_size;
+    hdr->mtime = mtime;
+}
+
+static int32_t entry_index(chm_file* h, chm_entry* e) {
+    if (e == NULL || e < h->entries || e >= h->entries + h->n_entries) {
+        return -1;
+    }
+    return (int32_t)(e - h->entries);
+}
+
+static bool write_all(FILE* fp, const void* data, size_t len) {
+    return len == 0 || fwrite(data, 1, len, fp) == len;
+}
+
+static bool read_all(FILE* fp, void* data, size_t len) {
+    return len == 0 || fread(data, 1, len, fp) == len;
+}
+
+bool chm_index_save(chm_file* h, const char* path, int64_t file_size, int64_t mtime) {
+    if (!chm_load_entries(h)) {
+        return false;
+    }
+
+    index_hdr hdr;
+    index_hdr_init(&hdr, file_size, mtime);
+    hdr.itsf = h->itsf;
+    hdr.itsp = h->itsp;
+    hdr.reset_table = h->reset_table;
+    hdr.compression_enabled = h->compression_enabled;
+    hdr.window_size = h->window_size;
+    hdr.reset_interval = h->reset_interval;
+    hdr.reset_blkcount = h->reset_blkcount;
+    /* after chm_parse_lazy() these were resolved outside of entries */
+    hdr.rt_unit = entry_index(h, chm_find_entry_nocase(h, CHMU_RESET_TABLE));
+    hdr.cn_unit = entry_index(h, chm_find_entry_nocase(h, CHMU_CONTENT));
+    hdr.parse_entries_failed = h->parse_entries_failed;
+    hdr.n_entries = h->n_entries;
+    hdr.path_index_len = h->path_index != NULL ? h->path_index_mask + 1 : 0;
+    hdr.n_reset_offsets = h->reset_offsets != NULL ? h->n_reset_offsets : 0;
+    const char* last = h->entries[h->n_entries - 1].path;
+    hdr.paths_len = (int64_t)(last + strlen(last) + 1 - h->entry_paths);
+
+    index_entry* entries =
+        (index_entry*)chm_calloc((size_t)h->n_entries, sizeof(index_entry));
+    if (entries == NULL) {
+        return false;
+    }
+    for (int i = 0; i < h->n_entries; i++) {
+        chm_entry* e = &h->entries[i];
+        entries[i].start = e->start;
+        entries[i].length = e->length;
+        entries[i].path_off = (int64_t)(e->path - h->entry_paths);
+        entries[i].space = e->space;
+        entries[i].flags = e->flags;
+    }
+
+    bool ok = false;
+    FILE* fp = fopen(path, "wb");
+    if (fp != NULL) {
+        ok = write_all(fp, &hdr, sizeof(hdr)) &&
+             write_all(fp, entries, (size_t)h->n_entries * sizeof(index_entry)) &&
+             write_all(fp, h->reset_offsets, (size_t)hdr.n_reset_offsets * sizeof(int64_t)) &&
+             write_all(fp, h->path_index, (size_t)hdr.path_index_len * sizeof(int32_t)) &&
+             write_all(fp, h->entry_paths, (size_t)hdr.paths_len);
+        if (fclose(fp) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            remove(path);
+        }
+    }
+    chm_free(entries);
+    return ok;
+}
+
+static bool index_hdr_valid(const index_hdr* hdr, int64_t file_size, int64_t mtime) {
+    index_hdr expected;
+    index_hdr_init(&expected, file_size, mtime);
+    /* everything up to the ITSF header must match exactly */
+    if (memcmp(hdr, &expected, offsetof(index_hdr, itsf)) != 0) {
+        return false;
+    }
+    if (hdr->n_entries <= 0 || hdr->paths_len <= 0 || hdr->paths_len > (int64_t)INT32_MAX) {
+        return false;
+    }
+    if (hdr->n_reset_offsets < 0 || hdr->n_reset_offsets > CHM_MAX_RESET_TABLE_ENTRIES) {
+        return false;
+    }
+    uint32_t n = hdr->path_index_len;
+    if (n != 0 && ((n & (n - 1)) != 0 || n < (uint32_t)hdr->n_entries * 2)) {
+        return false;
+    }
+    if (hdr->rt_unit >= hdr->n_entries || hdr->cn_unit >= hdr->n_entries) {
+        return false;
+    }
+    if (hdr->compression_enabled &&
+        (hdr->rt_unit < 0 || hdr->cn_unit < 0 || hdr->reset_blkcount == 0 ||
+         hdr->window_size == 0 || hdr->reset_table.block_len <= 0)) {
+        return false;
+    }
+    return true;
+}
+
+bool chm_index_load(chm_file* h, chm_reader read_func, void* read_ctx, const char* path,
+                    int64_t file_size, int64_t mtime) {
+    index_entry* entries = NULL;
+    index_hdr hdr;
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    if (!read_all(fp, &hdr, sizeof(hdr)) || !index_hdr_valid(&hdr, file_size, mtime)) {
+        fclose(fp);
+        return false;
+    }
+
+    if (!init_handle(h, read_func, read_ctx)) {
+        goto Error;
+    }
+
+    /* catch archives that were replaced without changing size or mtime */
+    itsf_hdr itsf;
+    memzero(&itsf, sizeof(itsf));
+    if (!read_itsf_header(h, &itsf) || memcmp(&itsf, &hdr.itsf, sizeof(itsf)) != 0) {
+        goto Error;
+    }
+
+    int n_entries = hdr.n_entries;
+    size_t paths_len = (size_t)hdr.paths_len;
+    entries = (index_entry*)chm_alloc((size_t)n_entries * sizeof(index_entry));
+    h->entries = (chm_entry*)chm_alloc((size_t)n_entries * sizeof(chm_entry));
+    h->entry_paths = (char*)chm_alloc(paths_len);
+    if (hdr.n_reset_offsets > 0) {
+        h->reset_offsets = (int64_t*)chm_alloc((size_t)hdr.n_reset_offsets * sizeof(int64_t));
+    }
+    if (hdr.path_index_len > 0) {
+        h->path_index = (int32_t*)chm_alloc((size_t)hdr.path_index_len * sizeof(int32_t));
+    }
+    if (entries == NULL || h->entries == NULL || h->entry_paths == NULL ||
+        (hdr.n_reset_offsets > 0 && h->reset_offsets == NULL) ||
+        (hdr.path_index_len > 0 && h->path_index == NULL)) {
+        goto Error;
+    }
 
+    if (!read_all(fp, entries, (size_t)n_entries * sizeof(index_entry)) ||
+        !read_all(fp, h->reset_offsets, (size_t)hdr.n_reset_offsets * sizeof(int64_t)) ||
+        !read_all(fp, h->path_index, (size_t)hdr.path_index_len * sizeof(int32_t)) ||
+        !read_all(fp, h->entry_paths, paths_len)) {
+        goto Error;
+    }
+    if (h->entry_paths[paths_len - 1] != '\0') {
+        goto Error;
+    }
+    for (uint32_t i = 0; i < hdr.path_index_len; i++) {
+        if (h->path_index[i] < 0 || h->path_index[i] > n_entries) {
+            goto Error;
+        }
+    }
+    for (int i = 0; i < n_entries; i++) {
+        index_entry* ie = &entries[i];
+        if (ie->path_off < 0 || ie->path_off >= (int64_t)paths_len) {
+            goto Error;
+        }
+        chm_entry* e = &h->entries[i];
+        e->path = h->entry_paths + ie->path_off;
+        e->start = ie->start;
+        e->length = ie->length;
+        e->space = ie->space;
+        e->flags = ie->flags;
+    }
+    chm_free(entries);
+    entries = NULL;
+    fclose(fp);
+    fp = NULL;
+
+    h->itsf = hdr.itsf;
+    h->itsp = hdr.itsp;
+    h->dir_offset = h->itsf.dir_offset + h->itsp.header_len;
+    h->dir_len = h->itsf.dir_len - h->itsp.header_len;
+    h->n_entries = n_entries;
+    h->path_index_mask = hdr.path_index_len > 0 ? hdr.path_index_len - 1 : 0;
+    h->parse_entries_failed = hdr.parse_entries_failed != 0;
+    h->rt_unit = hdr.rt_unit >= 0 ? &h->entries[hdr.rt_unit] : NULL;
+    h->cn_unit = hdr.cn_unit >= 0 ? &h->entries[hdr.cn_unit] : NULL;
+    h->reset_table = hdr.reset_table;
+    h->n_reset_offsets = hdr.n_reset_offsets;
+    h->compression_enabled = hdr.compression_enabled != 0;
+    h->window_size = hdr.window_size;
+    h->reset_interval = hdr.reset_interval;
+    h->reset_blkcount = hdr.reset_blkcount;
+    init_cache(h);
     return true;
+
 Error:
+    chm_free(entries);
+    if (fp != NULL) {
+        fclose(fp);
+    }
     chm_close(h);
     return false;
 }
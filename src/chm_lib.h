@@ -45,6 +45,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -85,6 +86,20 @@ bool fd_reader_init(fd_reader_ctx* ctx, const char* path);
 void fd_reader_close(fd_reader_ctx* ctx);
 int64_t fd_reader(void* ctx, void* buf, int64_t off, int64_t len);
 
+/* maps the whole file into memory. Reads are memcpy and the library decompresses
+straight from the mapping and hands out pointers into it, see chm_retrieve_view() */
+typedef struct mmap_reader_ctx {
+    mem_reader_ctx mem;
+#ifdef WIN32
+    HANDLE fh;
+    HANDLE mapping;
+#endif
+} mmap_reader_ctx;
+
+bool mmap_reader_init(mmap_reader_ctx* ctx, const char* path);
+void mmap_reader_close(mmap_reader_ctx* ctx);
+int64_t mmap_reader(void* ctx, void* buf, int64_t off, int64_t len);
+
 #ifdef WIN32
 typedef struct win_reader_ctx { HANDLE fh; } win_reader_ctx;
 
@@ -140,7 +155,6 @@ typedef struct lzxc_reset_table {
 } lzxc_reset_table;
 
 typedef struct chm_entry {
-    struct chm_entry* next;
     char* path;
     int64_t start;
     int64_t length;
@@ -148,7 +162,11 @@ typedef struct chm_entry {
     int flags;
 } chm_entry;
 
-#define MAX_CACHE_BLOCKS 128
+/* opaque per-thread decompressor state, see chm_session_new() */
+typedef struct chm_session chm_session;
+
+/* opaque cache of decompressed blocks shared by all sessions of a chm_file */
+typedef struct chm_cache chm_cache;
 
 /* the structure used for chm file handles */
 typedef struct chm_file {
@@ -165,6 +183,9 @@ typedef struct chm_file {
     chm_entry* cn_unit;
 
     lzxc_reset_table reset_table;
+    /* entries of the reset table, loaded by chm_parse() */
+    int64_t* reset_offsets;
+    int64_t n_reset_offsets;
 
     /* LZX control data */
     bool compression_enabled;
@@ -172,36 +193,317 @@ typedef struct chm_file {
     uint32_t reset_interval;
     uint32_t reset_blkcount;
 
-    /* decompressor state */
-    struct lzx_state* lzx_state;
-    int lzx_last_block;
-    uint8_t* lzx_last_block_data;
+    /* decompressed blocks, shared by all sessions */
+    chm_cache* cache;
 
-    /* cache for decompressed blocks */
-    uint8_t* cache_blocks[MAX_CACHE_BLOCKS];
-    int64_t cache_block_indices[MAX_CACHE_BLOCKS];
-    int n_cache_blocks;
+    /* session used by chm_retrieve_entry() */
+    chm_session* session;
 
-    chm_entry** entries;
+    /* all entries, in directory order. Their paths are in entry_paths */
+    chm_entry* entries;
     int n_entries;
+    char* entry_paths;
+    /* entries looked up by chm_find_entry() before chm_load_entries() */
+    struct chm_resolved_entry* resolved_entries;
+    /* hash table of entries by path, see chm_find_entry() */
+    int32_t* path_index;
+    uint32_t path_index_mask;
     /* might be a partial failure i.e. might still have entries */
     bool parse_entries_failed;
 } chm_file;
 
 void chm_close(struct chm_file* h);
 
+/* limit the cache of decompressed blocks to nCacheBlocks blocks or maxBytes bytes */
 void chm_set_cache_size(struct chm_file* h, int nCacheBlocks);
+void chm_set_cache_bytes(struct chm_file* h, int64_t maxBytes);
+
+/* snapshot the decompressor every nBlocks blocks within a reset interval, up to
+maxBytes in total, so that reading a block far from a reset point resumes from
+the nearest snapshot instead of decompressing every block since the reset.
+A snapshot is about the size of the LZX window. Off by default, and 0 turns it
+off again. Must not be called while other threads are using the file. */
+void chm_set_checkpoints(struct chm_file* h, int nBlocks, int64_t maxBytes);
+
+typedef struct chm_cache_stats {
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    /* blocks and bytes currently cached */
+    int64_t blocks;
+    int64_t bytes;
+    int64_t max_bytes;
+} chm_cache_stats;
+
+void chm_get_cache_stats(struct chm_file* h, chm_cache_stats* stats);
+
+/* what the library has done for a chm_file so far, by all of its sessions */
+typedef struct chm_stats {
+    /* calls to the reader and the bytes they returned */
+    int64_t reads;
+    int64_t read_bytes;
+    /* blocks decompressed, and how many of those were decompressed only to get
+    the decompressor to a later block */
+    int64_t blocks_decoded;
+    int64_t blocks_redecoded;
+    /* decompressions resumed from a snapshot, see chm_set_checkpoints() */
+    int64_t checkpoint_restores;
+    /* blocks found in the dedup cache instead of decompressed, see chm_set_dedup_bytes() */
+    int64_t blocks_deduped;
+    /* time spent decompressing blocks, in nanoseconds */
+    int64_t decode_ns;
+    chm_cache_stats cache;
+} chm_stats;
+
+void chm_get_stats(struct chm_file* h, chm_stats* stats);
+
+typedef enum chm_event_type {
+    /* the reader returned len bytes at offset off */
+    CHM_EVENT_READ,
+    /* block number off, len bytes long, was decompressed */
+    CHM_EVENT_DECODE
+} chm_event_type;
+
+typedef struct chm_event {
+    chm_event_type type;
+    int64_t off;
+    int64_t len;
+    /* how long it took, in nanoseconds */
+    int64_t ns;
+} chm_event;
+
+typedef void (*chm_event_func)(void* ctx, const chm_event* ev);
+
+/* call f after every read and every block decompressed, e.g. to collect latency
+histograms. It's called by whichever thread did the work, so must be thread-safe
+if the file is used from several threads. NULL turns it off. Must not be called
+while other threads are using the file. */
+void chm_set_event_hook(struct chm_file* h, chm_event_func f, void* ctx);
 
 bool chm_parse(struct chm_file* f, chm_reader read_func, void* read_ctx);
 
+/* like chm_parse() but only reads the headers and the entries needed for
+decompression. Other entries are read from the directory as chm_find_entry()
+asks for them, and entries/n_entries stay empty until chm_load_entries().
+chm_find_entry() may be called from several threads, chm_load_entries() may not. */
+bool chm_parse_lazy(struct chm_file* f, chm_reader read_func, void* read_ctx);
+bool chm_load_entries(struct chm_file* f);
+
+/* save everything chm_parse() reads to a sidecar file, so that chm_index_load()
+can open the archive without reading its directory. file_size and mtime identify
+the archive and are stored as given; the ITSF header is checked as well.
+chm_index_load() returns false if the index is missing, stale or unreadable,
+in which case the caller should fall back to chm_parse(). */
+bool chm_index_save(struct chm_file* f, const char* path, int64_t file_size, int64_t mtime);
+bool chm_index_load(struct chm_file* f, chm_reader read_func, void* read_ctx, const char* path,
+                    int64_t file_size, int64_t mtime);
+
+/* allow replacing malloc/free for all memory allocated by the library, including
+LZX windows, cache blocks and entries. ctx is passed to every call. It must be
+set before the first chm_parse() and not changed while any chm_file is open.
+NULL restores malloc/realloc/free. */
+typedef struct chm_allocator {
+    void* (*alloc)(void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* p, size_t size);
+    void (*free)(void* ctx, void* p);
+    void* ctx;
+} chm_allocator;
+
+void chm_set_allocator(const chm_allocator* a);
+
+/* decompressor states, with their LZX windows, are kept in a process-wide pool
+when sessions are freed and reused by later sessions of any chm_file with the
+same window size (up to CHM_LZX_POOL_SIZE of each). This frees them, e.g.
+before exit or after closing a batch of archives. chm_set_allocator() does it
+as well. */
+void chm_clear_lzx_pool(void);
+
+/* share decompressed blocks between chm_files, for collections holding many
+versions of the same archive. A block whose compressed data, and that of the
+blocks since its reset point, is the same as that of a block decompressed for
+another file is taken from it instead of being decompressed again, and both
+files' caches use the same copy of it. Up to maxBytes of blocks are kept in a
+process-wide cache; 0, the default, turns it off. Only files parsed while it's
+on take part. Blocks are matched by a SHA-256 hash chain over their compressed
+data, so an archive can't be crafted to be served another's blocks. The first
+call must be made before other threads use the library, later ones are safe at
+any time. */
+void chm_set_dedup_bytes(int64_t maxBytes);
+
 /* allow intercepting debug messages from the code */
 typedef void (*dbgprintfunc)(const char* s);
 void chm_set_dbgprint(dbgprintfunc f);
 
+/* find the entry with the given path using a hash table built by chm_parse().
+Returns NULL if there's none. chm_find_entry() compares paths exactly,
+chm_find_entry_nocase() ignores ASCII case like CHM URLs do. */
+chm_entry* chm_find_entry(struct chm_file* h, const char* path);
+chm_entry* chm_find_entry_nocase(struct chm_file* h, const char* path);
+
+/* called by chm_extract_all() with the data of entry e from addr to addr + len.
+Entries are passed one at a time with their data in order, ending with addr + len ==
+e->length. Empty entries get one call with len 0. If an entry can't be read completely,
+its last call has data set to NULL. Return false to stop the extraction. */
+typedef bool (*chm_extract_func)(void* ctx, chm_entry* e, int64_t addr, const uint8_t* data,
+                                 int64_t len);
+
+/* pass the data of all entries to f, ordered by their position in the archive so
+that the compressed content is decompressed in one pass. Uses its own session.
+Returns false if f stopped the extraction or on failure to allocate. */
+bool chm_extract_all(struct chm_file* h, chm_extract_func f, void* ctx);
+
+/* like chm_extract_all() but decompresses reset intervals on n_threads threads
+at once. f is still only called from the calling thread, in the same order. */
+bool chm_extract_all_parallel(struct chm_file* h, int n_threads, chm_extract_func f, void* ctx);
+
+/* hint that the compressed content is about to be read front to back, e.g. when
+extracting everything. mmap_reader and fd_reader pass it on to the OS */
+void chm_advise_sequential(struct chm_file* h);
+
 /* retrieve part of an entry from the archive */
 int64_t chm_retrieve_entry(struct chm_file* h, chm_entry* e, unsigned char* buf, int64_t addr,
                            int64_t len);
 
+/*
+Sessions allow several threads to read from one parsed chm_file at the same time.
+The parsed part of chm_file (headers, entries, reset table) is shared read-only and
+each session has its own LZX decompressor. Decompressed blocks go to a cache shared
+by all sessions, so a block decompressed by one thread is a memcpy for the others.
+A session must only be used by one thread at a time, read_func must be safe to call
+concurrently (mem_reader, win_reader and fd_reader, except on Windows, are) and all
+sessions must be freed before chm_close().
+chm_retrieve_entry() uses a session owned by chm_file, so it is not safe to call it
+concurrently on the same chm_file. */
+chm_session* chm_session_new(struct chm_file* h);
+void chm_session_free(chm_session* s);
+int64_t chm_session_retrieve_entry(chm_session* s, chm_entry* e, unsigned char* buf, int64_t addr,
+                                   int64_t len);
+
+/* once the session decompresses blocks in order, read the compressed data of the
+next nBlocks blocks with one read on a background thread while the current ones
+are decompressed. Off (0) by default, has no effect with mem_reader and mmap_reader.
+Returns false if there's not enough memory. */
+bool chm_session_set_readahead(chm_session* s, int nBlocks);
+
+/* a piece of an entry for chm_retrieve_batch() to read into buf */
+typedef struct chm_retrieve_request {
+    chm_entry* entry;
+    int64_t addr;
+    int64_t len;
+    unsigned char* buf;
+    /* set to the number of bytes read, like chm_retrieve_entry() returns */
+    int64_t n_read;
+} chm_retrieve_request;
+
+/* read many pieces of entries at once. The requests are served in the order of
+their data in the archive, each needed block is decompressed once for the whole
+batch however the requests are ordered, and with n_threads > 1 reset intervals are
+decompressed on up to n_threads threads. Uses its own sessions, so it can run at the
+same time as other sessions. Returns false if any request wasn't read completely. */
+bool chm_retrieve_batch(struct chm_file* h, chm_retrieve_request* reqs, int n, int n_threads);
+
+/*
+Views give access to an entry's data without copying it. Each chm_view_next()
+sets data and len to the next piece of the entry: a range of a decompressed
+block, pinned in the cache, or of the file itself when the reader holds it in
+memory. Readers that don't are read into a buffer owned by the view.
+data is valid until the next chm_view_next() or chm_view_close().
+
+chm_view v;
+if (chm_retrieve_view(s, e, 0, e->length, &v)) {
+    while (chm_view_next(&v)) {
+        write(fd, v.data, v.len);
+    }
+    chm_view_close(&v);
+}
+
+chm_view_next() returns false at the end or on failure, in which case failed is set.
+The view uses the session's decompressor, so the session can't be used for
+anything else until chm_view_close(). */
+typedef struct chm_view {
+    const uint8_t* data;
+    int64_t len;
+    bool failed;
+
+    /* private */
+    chm_session* session;
+    chm_entry* entry;
+    int64_t addr;
+    int64_t end;
+    void* pinned;
+    uint8_t* buf;
+} chm_view;
+
+bool chm_retrieve_view(chm_session* s, chm_entry* e, int64_t addr, int64_t len, chm_view* v);
+bool chm_view_next(chm_view* v);
+void chm_view_close(chm_view* v);
+
+/*
+Non-blocking retrieval, for callers that can't let read_func block, e.g. event
+loops reading archives from remote storage. It never calls read_func: whenever
+it needs data from the file, chm_async_step() returns CHM_ASYNC_NEED_READ and
+the caller reads it however it likes, then reports back with chm_async_feed().
+
+chm_async a;
+if (chm_async_start(&a, s, e, buf, addr, len)) {
+    while (chm_async_step(&a) == CHM_ASYNC_NEED_READ) {
+        // later, e.g. once an asynchronous read completes
+        n = read(fd, a.read_buf, a.read_len, a.read_off);
+        chm_async_feed(&a, n);
+    }
+}
+
+Blocks found in the cache are copied without reading anything, and the reader's
+memory is used directly when it holds the file, so with mem_reader and
+mmap_reader reads are only needed for the last blocks of the file. Like a view,
+a request uses its session's decompressor and buffers, so the session can't be
+used for anything else until the request is done; use one session per request
+in flight. chm_parse() still reads synchronously, and reset table entries it
+didn't preload are requested from the file like the compressed data. */
+typedef enum chm_async_status {
+    /* n_read is the clipped length of the request */
+    CHM_ASYNC_DONE,
+    /* read read_len bytes at offset read_off into read_buf, then chm_async_feed() */
+    CHM_ASYNC_NEED_READ,
+    /* stopped after n_read bytes, because of a short read or corrupt data */
+    CHM_ASYNC_FAILED
+} chm_async_status;
+
+typedef struct chm_async {
+    uint8_t* read_buf;
+    int64_t read_off;
+    int64_t read_len;
+    /* bytes copied to buf so far */
+    int64_t n_read;
+
+    /* private */
+    chm_session* session;
+    chm_entry* entry;
+    unsigned char* buf;
+    int64_t addr;
+    int64_t len;
+    int state;
+    int64_t fed;
+    /* block being copied and the next block to decompress to get to it */
+    int64_t block;
+    int64_t decode;
+    /* compressed data of decode when have_bounds */
+    bool have_bounds;
+    int64_t cmp_start;
+    int64_t cmp_len;
+    uint8_t rt_buf[16];
+} chm_async;
+
+/* start reading len bytes of e from addr into buf, clipped like
+chm_retrieve_entry(). Returns false if the entry can't be read at all */
+bool chm_async_start(chm_async* a, chm_session* s, chm_entry* e, unsigned char* buf,
+                     int64_t addr, int64_t len);
+/* go as far as possible without reading. Returns CHM_ASYNC_NEED_READ again until
+the read it asked for is fed */
+chm_async_status chm_async_step(chm_async* a);
+/* n is what reading read_len bytes into read_buf returned, < 0 on failure */
+void chm_async_feed(chm_async* a, int64_t n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,14 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LZX_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define LZX_NEON
+#endif
+
 /* some constants defined by the LZX specification */
 #define LZX_MIN_MATCH 2
 /* #define LZX_MAX_MATCH 257 */
@@ -51,7 +59,7 @@
 #define LZX_PRETREE_MAXSYMBOLS LZX_PRETREE_NUM_ELEMENTS
 #define LZX_PRETREE_TABLEBITS 6
 #define LZX_MAINTREE_MAXSYMBOLS (LZX_NUM_CHARS + 50 * 8)
-#define LZX_MAINTREE_TABLEBITS 12
+#define LZX_MAINTREE_TABLEBITS 13
 #define LZX_LENGTH_MAXSYMBOLS (LZX_NUM_SECONDARY_LENGTHS + 1)
 #define LZX_LENGTH_TABLEBITS 12
 #define LZX_ALIGNED_MAXSYMBOLS LZX_ALIGNED_NUM_ELEMENTS
@@ -67,6 +75,7 @@ struct lzx_state {
     uint8_t* window;          /* the actual decoding window              */
     uint32_t window_size;     /* window size (32Kb through 2Mb)          */
     uint32_t actual_size;     /* window size when it was first allocated */
+    int window_bits;          /* log2 of window_size, selects the decoders */
     uint32_t window_posn;     /* current offset within the window        */
     uint32_t R0, R1, R2;      /* for the LRU offset system               */
     uint16_t main_elements;   /* number of main tree elements            */
@@ -151,6 +160,19 @@ static const uint32_t position_base[51] = {
     98304,   131072,  196608,  262144,  393216,  524288,  655360, 786432, 917504, 1048576, 1179648,
     1310720, 1441792, 1572864, 1703936, 1835008, 1966080, 2097152};
 
+/* number of position slots for a window of 2^window bytes */
+static int position_slots(int window) {
+    if (window == 20)
+        return 42;
+    else if (window == 21)
+        return 50;
+    else
+        return window << 1;
+
+    /** alternatively **/
+    /* posn_slots=i=0; while (i < wndsize) i += 1 << extra_bits[posn_slots++]; */
+}
+
 struct lzx_state* lzx_init(int window) {
     struct lzx_state* pState = NULL;
     uint32_t wndsize = 1 << window;
@@ -162,24 +184,17 @@ struct lzx_state* lzx_init(int window) {
         return NULL;
 
     /* allocate state and associated window */
-    pState = (struct lzx_state*)malloc(sizeof(struct lzx_state));
-    if (!pState || !(pState->window = (uint8_t*)malloc(wndsize))) {
-        free(pState);
+    pState = (struct lzx_state*)chm_alloc(sizeof(struct lzx_state));
+    if (!pState || !(pState->window = (uint8_t*)chm_alloc(wndsize))) {
+        chm_free(pState);
         return NULL;
     }
     pState->actual_size = wndsize;
     pState->window_size = wndsize;
+    pState->window_bits = window;
 
     /* calculate required position slots */
-    if (window == 20)
-        posn_slots = 42;
-    else if (window == 21)
-        posn_slots = 50;
-    else
-        posn_slots = window << 1;
-
-    /** alternatively **/
-    /* posn_slots=i=0; while (i < wndsize) i += 1 << extra_bits[posn_slots++]; */
+    posn_slots = position_slots(window);
 
     /* initialize other state */
     pState->R0 = pState->R1 = pState->R2 = 1;
@@ -204,8 +219,8 @@ struct lzx_state* lzx_init(int window) {
 void lzx_teardown(struct lzx_state* pState) {
     if (pState) {
         if (pState->window)
-            free(pState->window);
-        free(pState);
+            chm_free(pState->window);
+        chm_free(pState);
     }
 }
 
@@ -230,6 +245,41 @@ void lzx_reset(struct lzx_state* pState) {
     }
 }
 
+int lzx_rebind(struct lzx_state* pState, int window) {
+    if (window < 15 || window > 21 || ((uint32_t)1 << window) > pState->actual_size)
+        return DECR_DATAFORMAT;
+    pState->window_size = (uint32_t)1 << window;
+    pState->window_bits = window;
+    pState->main_elements = LZX_NUM_CHARS + (position_slots(window) << 3);
+    lzx_reset(pState);
+    return DECR_OK;
+}
+
+size_t lzx_snapshot_size(struct lzx_state* pState) {
+    return sizeof(struct lzx_state) + pState->window_size;
+}
+
+void lzx_snapshot(struct lzx_state* pState, void* buf) {
+    uint8_t* p = (uint8_t*)buf;
+    memcpy(p, pState, sizeof(struct lzx_state));
+    memcpy(p + sizeof(struct lzx_state), pState->window, pState->window_size);
+}
+
+int lzx_restore(struct lzx_state* pState, const void* buf) {
+    const uint8_t* p = (const uint8_t*)buf;
+    uint8_t* window = pState->window;
+    uint32_t actual_size = pState->actual_size;
+
+    /* the window itself is the only thing that isn't copied wholesale */
+    if (((const struct lzx_state*)p)->window_size > actual_size)
+        return DECR_DATAFORMAT;
+    memcpy(pState, p, sizeof(struct lzx_state));
+    pState->window = window;
+    pState->actual_size = actual_size;
+    memcpy(window, p + sizeof(struct lzx_state), pState->window_size);
+    return DECR_OK;
+}
+
 /* Bitstream reading macros:
  *
  * INIT_BITSTREAM    should be used first to set up the system
@@ -241,17 +291,18 @@ void lzx_reset(struct lzx_state* pState) {
  *
  * These bit access routines work by using the area beyond the MSB and the
  * LSB as a free source of zeroes. This avoids having to mask any bits.
- * So we have to know the bit width of the bitbuffer variable. This is
- * sizeof(uint32_t) * 8, also defined as uint32_t_BITS
+ * So we have to know the bit width of the bitbuffer variable, BITBUF_WIDTH.
+ *
+ * The buffer is refilled 32 bits at a time while there are at least 4 bytes
+ * of input left, and 16 bits at a time (which may read up to 2 bytes past
+ * the end, see the buffer exhaustion check) for the last bytes.
  */
 
-/* number of bits in uint32_t. Note: This must be at multiple of 16, and at
- * least 32 for the bitbuffer code to work (ie, it must be able to ensure
- * up to 17 bits - that's adding 16 bits when there's one bit left, or
- * adding 32 bits when there are no bits left. The code should work fine
- * for machines where uint32_t >= 32 bits.
+/* number of bits in the bit buffer. Note: This must be at least 32 + 17 so
+ * that a 32 bit refill always fits when up to 17 bits are needed.
  */
-#define uint32_t_BITS (sizeof(uint32_t) << 3)
+#define BITBUF_WIDTH 64
+typedef uint64_t bitbuf_t;
 
 #define INIT_BITSTREAM \
     do {               \
@@ -259,14 +310,25 @@ void lzx_reset(struct lzx_state* pState) {
         bitbuf = 0;    \
     } while (0)
 
-#define ENSURE_BITS(n)                                                             \
-    while (bitsleft < (n)) {                                                       \
-        bitbuf |= ((inpos[1] << 8) | inpos[0]) << (uint32_t_BITS - 16 - bitsleft); \
-        bitsleft += 16;                                                            \
-        inpos += 2;                                                                \
+/* the stream is made of 16 bit little endian words, most significant bit first */
+#define LOAD_WORD(p) (((uint32_t)(p)[1] << 8) | (uint32_t)(p)[0])
+#define LOAD_DWORD(p) (LOAD_WORD(p) | (LOAD_WORD((p) + 2) << 16))
+
+#define ENSURE_BITS(n)                                                                         \
+    while (bitsleft < (n)) {                                                                   \
+        if (endinp - inpos >= 4) {                                                             \
+            bitbuf |= (bitbuf_t)((LOAD_WORD(inpos) << 16) | LOAD_WORD(inpos + 2))             \
+                      << (BITBUF_WIDTH - 32 - bitsleft);                                       \
+            bitsleft += 32;                                                                    \
+            inpos += 4;                                                                        \
+        } else {                                                                               \
+            bitbuf |= (bitbuf_t)LOAD_WORD(inpos) << (BITBUF_WIDTH - 16 - bitsleft);            \
+            bitsleft += 16;                                                                    \
+            inpos += 2;                                                                        \
+        }                                                                                      \
     }
 
-#define PEEK_BITS(n) (bitbuf >> (uint32_t_BITS - (n)))
+#define PEEK_BITS(n) ((uint32_t)(bitbuf >> (BITBUF_WIDTH - (n))))
 #define REMOVE_BITS(n) ((bitbuf <<= (n)), (bitsleft -= (n)))
 
 #define READ_BITS(v, n)     \
@@ -294,21 +356,22 @@ void lzx_reset(struct lzx_state* pState) {
     }
 
 /* READ_HUFFSYM(tablename, var) decodes one huffman symbol from the
- * bitstream using the stated table and puts it in var.
+ * bitstream using the stated table and puts it in var. Codes of up to
+ * TABLEBITS bits take a single lookup, longer ones walk the tree one bit
+ * at a time, j being the number of bits looked at.
  */
 #define READ_HUFFSYM(tbl, var)                                             \
     do {                                                                   \
         ENSURE_BITS(16);                                                   \
         hufftbl = SYMTABLE(tbl);                                           \
         if ((i = hufftbl[PEEK_BITS(TABLEBITS(tbl))]) >= MAXSYMBOLS(tbl)) { \
-            j = 1 << (uint32_t_BITS - TABLEBITS(tbl));                     \
+            j = TABLEBITS(tbl);                                            \
             do {                                                           \
-                j >>= 1;                                                   \
-                i <<= 1;                                                   \
-                i |= (bitbuf & j) ? 1 : 0;                                 \
-                if (!j) {                                                  \
+                if (++j > 16) {                                            \
                     return DECR_ILLEGALDATA;                               \
                 }                                                          \
+                i <<= 1;                                                   \
+                i |= PEEK_BITS(j) & 1;                                     \
             } while ((i = hufftbl[i]) >= MAXSYMBOLS(tbl));                 \
         }                                                                  \
         j = LENTABLE(tbl)[(var) = i];                                      \
@@ -324,6 +387,7 @@ void lzx_reset(struct lzx_state* pState) {
         lb.bb = bitbuf;                                                   \
         lb.bl = bitsleft;                                                 \
         lb.ip = inpos;                                                    \
+        lb.end = endinp;                                                  \
         if (lzx_read_lens(pState, LENTABLE(tbl), (first), (last), &lb)) { \
             return DECR_ILLEGALDATA;                                      \
         }                                                                 \
@@ -428,10 +492,43 @@ static int make_decode_table(uint32_t nsyms, uint32_t nbits, uint8_t* length, ui
     return 0;
 }
 
+/* copy 16 bytes, src and dst must not overlap */
+static void copy16(uint8_t* dst, const uint8_t* src) {
+#if defined(LZX_SSE2)
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+#elif defined(LZX_NEON)
+    vst1q_u8(dst, vld1q_u8(src));
+#else
+    memcpy(dst, src, 16);
+#endif
+}
+
+/* copy a match of len bytes (none if len <= 0) from src to dst within the
+ * window. The copy only goes wide when src is at least 16 bytes behind dst,
+ * so every chunk is read after it was written, as in the byte loop */
+static void copy_match(uint8_t* dst, const uint8_t* src, int len) {
+    ptrdiff_t offset = dst - src;
+    if (offset >= 16) {
+        while (len >= 16) {
+            copy16(dst, src);
+            dst += 16;
+            src += 16;
+            len -= 16;
+        }
+    } else if (offset == 1 && len > 0) {
+        /* a run of one byte */
+        memset(dst, *src, (size_t)len);
+        return;
+    }
+    while (len-- > 0)
+        *dst++ = *src++;
+}
+
 struct lzx_bits {
-    uint32_t bb;
+    bitbuf_t bb;
     int bl;
     uint8_t* ip;
+    uint8_t* end;
 };
 
 static int lzx_read_lens(struct lzx_state* pState, uint8_t* lens, uint32_t first, uint32_t last,
@@ -439,9 +536,10 @@ static int lzx_read_lens(struct lzx_state* pState, uint8_t* lens, uint32_t first
     uint32_t i, j, x, y;
     int z;
 
-    uint32_t bitbuf = lb->bb;
+    bitbuf_t bitbuf = lb->bb;
     int bitsleft = lb->bl;
     uint8_t* inpos = lb->ip;
+    uint8_t* endinp = lb->end;
     uint16_t* hufftbl;
 
     for (x = 0; x < 20; x++) {
@@ -485,26 +583,189 @@ static int lzx_read_lens(struct lzx_state* pState, uint8_t* lens, uint32_t first
     return 0;
 }
 
+/* decoder state passed to and from the decode_run() instances */
+struct lzx_run {
+    struct lzx_bits bits;
+    uint32_t window_posn;
+    uint32_t R0, R1, R2;
+};
+
+#if defined(_MSC_VER)
+#define LZX_ALWAYS_INLINE __forceinline
+#elif defined(__GNUC__)
+#define LZX_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define LZX_ALWAYS_INLINE inline
+#endif
+
+/* decode this_run bytes of a verbatim or aligned offset block into the window.
+ * Only instantiated by LZX_DEFINE_DECODERS() with window_size and aligned as
+ * constants, so the block type branches and window arithmetic fold away */
+static LZX_ALWAYS_INLINE int decode_run(struct lzx_state* pState, struct lzx_run* run,
+                                        int this_run, const uint32_t window_size,
+                                        const int aligned) {
+    bitbuf_t bitbuf = run->bits.bb;
+    int bitsleft = run->bits.bl;
+    uint8_t* inpos = run->bits.ip;
+    uint8_t* endinp = run->bits.end;
+    uint8_t* window = pState->window;
+    uint8_t* runsrc, *rundest;
+    uint16_t* hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
+
+    uint32_t window_posn = run->window_posn;
+    uint32_t R0 = run->R0;
+    uint32_t R1 = run->R1;
+    uint32_t R2 = run->R2;
+
+    uint32_t match_offset, i, j; /* ij used in READ_HUFFSYM macro */
+    int main_element, aligned_bits;
+    int match_length, length_footer, extra, verbatim_bits;
+
+    while (this_run > 0) {
+        READ_HUFFSYM(MAINTREE, main_element);
+
+        if (main_element < LZX_NUM_CHARS) {
+            /* literal: 0 to LZX_NUM_CHARS-1 */
+            window[window_posn++] = main_element;
+            this_run--;
+            continue;
+        }
+
+        /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
+        main_element -= LZX_NUM_CHARS;
+
+        match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
+        if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
+            READ_HUFFSYM(LENGTH, length_footer);
+            match_length += length_footer;
+        }
+        match_length += LZX_MIN_MATCH;
+
+        match_offset = main_element >> 3;
+
+        if (match_offset > 2) {
+            /* not repeated offset */
+            extra = extra_bits[match_offset];
+            if (!aligned) {
+                if (match_offset != 3) {
+                    READ_BITS(verbatim_bits, extra);
+                    match_offset = position_base[match_offset] - 2 + verbatim_bits;
+                } else {
+                    match_offset = 1;
+                }
+            } else {
+                match_offset = position_base[match_offset] - 2;
+                if (extra > 3) {
+                    /* verbatim and aligned bits */
+                    extra -= 3;
+                    READ_BITS(verbatim_bits, extra);
+                    match_offset += (verbatim_bits << 3);
+                    READ_HUFFSYM(ALIGNED, aligned_bits);
+                    match_offset += aligned_bits;
+                } else if (extra == 3) {
+                    /* aligned bits only */
+                    READ_HUFFSYM(ALIGNED, aligned_bits);
+                    match_offset += aligned_bits;
+                } else if (extra > 0) { /* extra==1, extra==2 */
+                    /* verbatim bits only */
+                    READ_BITS(verbatim_bits, extra);
+                    match_offset += (uint32_t)verbatim_bits;
+                } else /* extra == 0 */ {
+                    /* ??? */
+                    match_offset = 1;
+                }
+            }
+
+            /* update repeated offset LRU queue */
+            R2 = R1;
+            R1 = R0;
+            R0 = match_offset;
+        } else if (match_offset == 0) {
+            match_offset = R0;
+        } else if (match_offset == 1) {
+            match_offset = R1;
+            R1 = R0;
+            R0 = match_offset;
+        } else /* match_offset == 2 */ {
+            match_offset = R2;
+            R2 = R0;
+            R0 = match_offset;
+        }
+
+        rundest = window + window_posn;
+        runsrc = rundest - match_offset;
+        window_posn += (uint32_t)match_length;
+        if (window_posn > window_size)
+            return DECR_ILLEGALDATA;
+        this_run -= match_length;
+
+        /* copy any wrapped around source data */
+        while ((runsrc < window) && (match_length-- > 0)) {
+            *rundest++ = *(runsrc + window_size);
+            runsrc++;
+        }
+        /* copy match data - no worries about destination wraps */
+        copy_match(rundest, runsrc, match_length);
+    }
+
+    run->bits.bb = bitbuf;
+    run->bits.bl = bitsleft;
+    run->bits.ip = inpos;
+    run->window_posn = window_posn;
+    run->R0 = R0;
+    run->R1 = R1;
+    run->R2 = R2;
+    return DECR_OK;
+}
+
+typedef int (*decode_run_func)(struct lzx_state* pState, struct lzx_run* run, int this_run);
+
+/* a verbatim and an aligned offset decoder for windows of 2^w bytes */
+#define LZX_DEFINE_DECODERS(w)                                                             \
+    static int decode_verbatim_##w(struct lzx_state* pState, struct lzx_run* run,          \
+                                   int this_run) {                                         \
+        return decode_run(pState, run, this_run, (uint32_t)1 << (w), 0);                   \
+    }                                                                                      \
+    static int decode_aligned_##w(struct lzx_state* pState, struct lzx_run* run,           \
+                                  int this_run) {                                          \
+        return decode_run(pState, run, this_run, (uint32_t)1 << (w), 1);                   \
+    }
+
+LZX_DEFINE_DECODERS(15)
+LZX_DEFINE_DECODERS(16)
+LZX_DEFINE_DECODERS(17)
+LZX_DEFINE_DECODERS(18)
+LZX_DEFINE_DECODERS(19)
+LZX_DEFINE_DECODERS(20)
+LZX_DEFINE_DECODERS(21)
+
+/* indexed by window_bits - 15 and then by whether the block is aligned */
+static const decode_run_func lzx_decoders[7][2] = {
+    {decode_verbatim_15, decode_aligned_15}, {decode_verbatim_16, decode_aligned_16},
+    {decode_verbatim_17, decode_aligned_17}, {decode_verbatim_18, decode_aligned_18},
+    {decode_verbatim_19, decode_aligned_19}, {decode_verbatim_20, decode_aligned_20},
+    {decode_verbatim_21, decode_aligned_21}};
+
 int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char* outpos, int inlen,
                    int outlen) {
     uint8_t* endinp = inpos + inlen;
     uint8_t* window = pState->window;
-    uint8_t* runsrc, *rundest;
-    uint16_t* hufftbl; /* used in READ_HUFFSYM macro as chosen decoding table */
 
     uint32_t window_posn = pState->window_posn;
     uint32_t window_size = pState->window_size;
     uint32_t R0 = pState->R0;
     uint32_t R1 = pState->R1;
     uint32_t R2 = pState->R2;
+    /* the verbatim and aligned offset decoders for this window size */
+    const decode_run_func* decoders = lzx_decoders[pState->window_bits - 15];
 
-    uint32_t bitbuf;
+    bitbuf_t bitbuf;
     int bitsleft;
-    uint32_t match_offset, i, j, k; /* ijk used in READ_HUFFSYM macro */
-    struct lzx_bits lb;             /* used in READ_LENGTHS macro */
+    uint32_t i, j, k;
+    struct lzx_bits lb; /* used in READ_LENGTHS macro */
+    struct lzx_run run; /* passed to the decoders */
 
-    int togo = outlen, this_run, main_element, aligned_bits;
-    int match_length, length_footer, extra, verbatim_bits;
+    int togo = outlen, this_run;
 
     INIT_BITSTREAM;
 
@@ -558,13 +819,14 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
                 case LZX_BLOCKTYPE_UNCOMPRESSED:
                     pState->intel_started = 1; /* because we can't assume otherwise */
                     ENSURE_BITS(16);           /* get up to 16 pad bits into the buffer */
-                    if (bitsleft > 16)
-                        inpos -= 2; /* and align the bitstream! */
-                    R0 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    /* and align the bitstream! The rest of the current word is
+                     * padding, whole words after it are given back */
+                    inpos -= ((bitsleft - 1) / 16) * 2;
+                    R0 = LOAD_DWORD(inpos);
                     inpos += 4;
-                    R1 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    R1 = LOAD_DWORD(inpos);
                     inpos += 4;
-                    R2 = inpos[0] | (inpos[1] << 8) | (inpos[2] << 16) | (inpos[3] << 24);
+                    R2 = LOAD_DWORD(inpos);
                     inpos += 4;
                     break;
 
@@ -601,149 +863,26 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
 
             switch (pState->block_type) {
                 case LZX_BLOCKTYPE_VERBATIM:
-                    while (this_run > 0) {
-                        READ_HUFFSYM(MAINTREE, main_element);
-
-                        if (main_element < LZX_NUM_CHARS) {
-                            /* literal: 0 to LZX_NUM_CHARS-1 */
-                            window[window_posn++] = main_element;
-                            this_run--;
-                        } else {
-                            /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
-                            main_element -= LZX_NUM_CHARS;
-
-                            match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
-                            if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
-                                READ_HUFFSYM(LENGTH, length_footer);
-                                match_length += length_footer;
-                            }
-                            match_length += LZX_MIN_MATCH;
-
-                            match_offset = main_element >> 3;
-
-                            if (match_offset > 2) {
-                                /* not repeated offset */
-                                if (match_offset != 3) {
-                                    extra = extra_bits[match_offset];
-                                    READ_BITS(verbatim_bits, extra);
-                                    match_offset = position_base[match_offset] - 2 + verbatim_bits;
-                                } else {
-                                    match_offset = 1;
-                                }
-
-                                /* update repeated offset LRU queue */
-                                R2 = R1;
-                                R1 = R0;
-                                R0 = match_offset;
-                            } else if (match_offset == 0) {
-                                match_offset = R0;
-                            } else if (match_offset == 1) {
-                                match_offset = R1;
-                                R1 = R0;
-                                R0 = match_offset;
-                            } else /* match_offset == 2 */ {
-                                match_offset = R2;
-                                R2 = R0;
-                                R0 = match_offset;
-                            }
-
-                            rundest = window + window_posn;
-                            runsrc = rundest - match_offset;
-                            window_posn += match_length;
-                            if (window_posn > window_size)
-                                return DECR_ILLEGALDATA;
-                            this_run -= match_length;
-
-                            /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size);
-                                runsrc++;
-                            }
-                            /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0)
-                                *rundest++ = *runsrc++;
-                        }
-                    }
-                    break;
-
                 case LZX_BLOCKTYPE_ALIGNED:
-                    while (this_run > 0) {
-                        READ_HUFFSYM(MAINTREE, main_element);
-
-                        if (main_element < LZX_NUM_CHARS) {
-                            /* literal: 0 to LZX_NUM_CHARS-1 */
-                            window[window_posn++] = main_element;
-                            this_run--;
-                        } else {
-                            /* match: LZX_NUM_CHARS + ((slot<<3) | length_header (3 bits)) */
-                            main_element -= LZX_NUM_CHARS;
-
-                            match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
-                            if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
-                                READ_HUFFSYM(LENGTH, length_footer);
-                                match_length += length_footer;
-                            }
-                            match_length += LZX_MIN_MATCH;
-
-                            match_offset = main_element >> 3;
-
-                            if (match_offset > 2) {
-                                /* not repeated offset */
-                                extra = extra_bits[match_offset];
-                                match_offset = position_base[match_offset] - 2;
-                                if (extra > 3) {
-                                    /* verbatim and aligned bits */
-                                    extra -= 3;
-                                    READ_BITS(verbatim_bits, extra);
-                                    match_offset += (verbatim_bits << 3);
-                                    READ_HUFFSYM(ALIGNED, aligned_bits);
-                                    match_offset += aligned_bits;
-                                } else if (extra == 3) {
-                                    /* aligned bits only */
-                                    READ_HUFFSYM(ALIGNED, aligned_bits);
-                                    match_offset += aligned_bits;
-                                } else if (extra > 0) { /* extra==1, extra==2 */
-                                    /* verbatim bits only */
-                                    READ_BITS(verbatim_bits, extra);
-                                    match_offset += (uint32_t)verbatim_bits;
-                                } else /* extra == 0 */ {
-                                    /* ??? */
-                                    match_offset = 1;
-                                }
-
-                                /* update repeated offset LRU queue */
-                                R2 = R1;
-                                R1 = R0;
-                                R0 = match_offset;
-                            } else if (match_offset == 0) {
-                                match_offset = R0;
-                            } else if (match_offset == 1) {
-                                match_offset = R1;
-                                R1 = R0;
-                                R0 = match_offset;
-                            } else /* match_offset == 2 */ {
-                                match_offset = R2;
-                                R2 = R0;
-                                R0 = match_offset;
-                            }
-
-                            rundest = window + window_posn;
-                            runsrc = rundest - match_offset;
-                            window_posn += (uint32_t)match_length;
-                            if (window_posn > window_size)
-                                return DECR_ILLEGALDATA;
-                            this_run -= match_length;
-
-                            /* copy any wrapped around source data */
-                            while ((runsrc < window) && (match_length-- > 0)) {
-                                *rundest++ = *(runsrc + window_size);
-                                runsrc++;
-                            }
-                            /* copy match data - no worries about destination wraps */
-                            while (match_length-- > 0)
-                                *rundest++ = *runsrc++;
-                        }
+                    run.bits.bb = bitbuf;
+                    run.bits.bl = bitsleft;
+                    run.bits.ip = inpos;
+                    run.bits.end = endinp;
+                    run.window_posn = window_posn;
+                    run.R0 = R0;
+                    run.R1 = R1;
+                    run.R2 = R2;
+                    if (decoders[pState->block_type == LZX_BLOCKTYPE_ALIGNED](pState, &run,
+                                                                             this_run)) {
+                        return DECR_ILLEGALDATA;
                     }
+                    bitbuf = run.bits.bb;
+                    bitsleft = run.bits.bl;
+                    inpos = run.bits.ip;
+                    window_posn = run.window_posn;
+                    R0 = run.R0;
+                    R1 = run.R1;
+                    R2 = run.R2;
                     break;
 
                 case LZX_BLOCKTYPE_UNCOMPRESSED:
@@ -783,11 +922,14 @@ int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char
             pState->intel_curpos = curpos + outlen;
 
             while (data < dataend) {
-                if (*data++ != 0xE8) {
-                    curpos++;
-                    continue;
+                /* memchr() is vectorized in any decent libc */
+                uint8_t* e8 = (uint8_t*)memchr(data, 0xE8, (size_t)(dataend - data));
+                if (e8 == NULL) {
+                    break;
                 }
-                abs_off = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+                curpos += (int32_t)(e8 - data);
+                data = e8 + 1;
+                abs_off = (int32_t)LOAD_DWORD(data);
                 if ((abs_off >= -curpos) && (abs_off < filesize)) {
                     rel_off = (abs_off >= 0) ? abs_off - curpos : abs_off + filesize;
                     data[0] = (uint8_t)rel_off;
@@ -29,12 +29,19 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 /* return codes */
 #define DECR_OK (0)
 #define DECR_DATAFORMAT (1)
 #define DECR_ILLEGALDATA (2)
 #define DECR_NOMEMORY (3)
 
+/* memory functions for states and windows. They're implemented in chm_lib.c
+ * so that chm_set_allocator() covers the LZX window as well */
+void* chm_alloc(size_t size);
+void chm_free(void* p);
+
 /* opaque state structure */
 struct lzx_state;
 
@@ -47,6 +54,16 @@ void lzx_teardown(struct lzx_state* pState);
 /* reset an lzx stream */
 void lzx_reset(struct lzx_state* pState);
 
+/* reuse a state for a new stream with a window of 2^window bytes, which must
+ * fit in the state's window. Returns DECR_OK or DECR_DATAFORMAT */
+int lzx_rebind(struct lzx_state* pState, int window);
+
+/* snapshots of the whole decoder state, including the window. A snapshot
+ * can be restored into any state with a window at least as big */
+size_t lzx_snapshot_size(struct lzx_state* pState);
+void lzx_snapshot(struct lzx_state* pState, void* buf);
+int lzx_restore(struct lzx_state* pState, const void* buf);
+
 /* decompress an LZX compressed block */
 int lzx_decompress(struct lzx_state* pState, unsigned char* inpos, unsigned char* outpos, int inlen,
                    int outlen);
@@ -0,0 +1,495 @@
+/***************************************************************************
+ *          bench.c - CHM archive benchmarks                               *
+ *                           -------------------                           *
+ *                                                                         *
+ *  notes:      Times parsing, lookups, sequential, random and batched     *
+ *              retrieval and raw LZX decompression of the given .chm      *
+ *              files, and prints one JSON object per measurement so that  *
+ *              results of different builds can be compared by scripts.    *
+ *                                                                         *
+ *              Random choices use a fixed seed, so every run does the     *
+ *              same work.                                                 *
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Lesser General Public License as        *
+ *   published by the Free Software Foundation; either version 2.1 of the  *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "chm_lib.h"
+#include "lzx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#define MAX_REPS 100
+/* largest piece read by one random retrieval */
+#define RANDOM_READ_MAX (64 * 1024)
+/* blocks decompressed by the lzx benchmark */
+#define LZX_MAX_BLOCKS 2048
+
+static int config_reps = 5;
+static int config_threads = 0;
+static int config_random_ops = 2000;
+static const char* config_only = NULL;
+
+struct bench {
+    const char* path;
+    mmap_reader_ctx ctx;
+    /* parsed once, for the entries and the reset table */
+    chm_file base;
+    /* parsed again before every repetition of benchmarks that need it */
+    chm_file f;
+    int cache_blocks;
+    int n_threads;
+    /* files among the entries of base, for lookups and random reads */
+    chm_entry** files;
+    int n_files;
+    /* captured compressed blocks for the lzx benchmark */
+    uint8_t* lzx_in;
+    int64_t* lzx_offsets;
+    int lzx_blocks;
+    /* work done by a repetition */
+    int64_t ops;
+    int64_t bytes;
+};
+
+typedef bool (*bench_func)(struct bench* b);
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the same sequence of numbers on every run */
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+static int cmp_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* run fn config_reps times and print the best and median times. With parse
+ * set, each repetition gets a freshly parsed b->f, so caches start out cold */
+static void run_bench(struct bench* b, const char* name, const char* param, bool parse,
+                      bench_func fn) {
+    int64_t times[MAX_REPS];
+    int64_t ops = 0;
+    int64_t bytes = 0;
+
+    if (config_only != NULL && strcmp(config_only, name) != 0) {
+        return;
+    }
+    for (int i = 0; i < config_reps; i++) {
+        if (parse) {
+            if (!chm_parse(&b->f, mmap_reader, &b->ctx)) {
+                fprintf(stderr, "%s: chm_parse() failed\n", b->path);
+                return;
+            }
+            if (b->cache_blocks > 0) {
+                chm_set_cache_size(&b->f, b->cache_blocks);
+            }
+        }
+        b->ops = 0;
+        b->bytes = 0;
+        int64_t start = now_ns();
+        bool ok = fn(b);
+        times[i] = now_ns() - start;
+        if (parse) {
+            chm_close(&b->f);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: %s %s failed\n", b->path, name, param);
+            return;
+        }
+        ops = b->ops;
+        bytes = b->bytes;
+    }
+    qsort(times, (size_t)config_reps, sizeof(int64_t), cmp_int64);
+    int64_t best = times[0] > 0 ? times[0] : 1;
+    printf("{\"file\": \"%s\", \"bench\": \"%s\", \"param\": \"%s\", \"reps\": %d, "
+           "\"ops\": %lld, \"bytes\": %lld, \"best_ns\": %lld, \"median_ns\": %lld, "
+           "\"ns_per_op\": %.1f, \"mb_per_s\": %.2f}\n",
+           b->path, name, param, config_reps, (long long)ops, (long long)bytes, (long long)best,
+           (long long)times[config_reps / 2], ops ? (double)best / (double)ops : 0.0,
+           (double)bytes * 1e9 / (double)best / (1024.0 * 1024.0));
+    fflush(stdout);
+}
+
+#define PARSE_ITERATIONS 20
+
+static bool bench_parse(struct bench* b) {
+    for (int i = 0; i < PARSE_ITERATIONS; i++) {
+        chm_file f;
+        if (!chm_parse(&f, mmap_reader, &b->ctx)) {
+            return false;
+        }
+        chm_close(&f);
+    }
+    b->ops = PARSE_ITERATIONS;
+    return true;
+}
+
+static bool bench_parse_lazy(struct bench* b) {
+    for (int i = 0; i < PARSE_ITERATIONS; i++) {
+        chm_file f;
+        if (!chm_parse_lazy(&f, mmap_reader, &b->ctx)) {
+            return false;
+        }
+        chm_close(&f);
+    }
+    b->ops = PARSE_ITERATIONS;
+    return true;
+}
+
+#define LOOKUP_OPS 200000
+
+static bool bench_lookup(struct bench* b) {
+    uint32_t seed = 1;
+    for (int i = 0; i < LOOKUP_OPS; i++) {
+        chm_entry* e = b->files[next_random(&seed) % (uint32_t)b->n_files];
+        if (chm_find_entry(&b->base, e->path) == NULL) {
+            return false;
+        }
+    }
+    b->ops = LOOKUP_OPS;
+    return true;
+}
+
+static bool count_extracted(void* ctx, chm_entry* e, int64_t addr, const uint8_t* data,
+                            int64_t len) {
+    struct bench* b = (struct bench*)ctx;
+    if (data == NULL && e->length > 0) {
+        return false;
+    }
+    b->bytes += len;
+    if (addr + len == e->length) {
+        b->ops++;
+    }
+    return true;
+}
+
+static bool bench_extract(struct bench* b) {
+    return chm_extract_all(&b->f, count_extracted, b);
+}
+
+static bool bench_extract_parallel(struct bench* b) {
+    return chm_extract_all_parallel(&b->f, b->n_threads, count_extracted, b);
+}
+
+/* a random piece of up to RANDOM_READ_MAX bytes of a random file. The entries
+ * of b->base describe b->f just as well, both parsed the same file */
+static chm_entry* random_piece(struct bench* b, uint32_t* seed, int64_t* addr, int64_t* len) {
+    chm_entry* e = b->files[next_random(seed) % (uint32_t)b->n_files];
+    *len = e->length < RANDOM_READ_MAX ? e->length : RANDOM_READ_MAX;
+    *addr = 0;
+    if (e->length > *len) {
+        *addr = (int64_t)(next_random(seed) % (uint32_t)(e->length - *len + 1));
+    }
+    return e;
+}
+
+static bool random_reads(struct bench* b, chm_session* s, uint32_t seed, int n, int64_t* bytes) {
+    uint8_t* buf = (uint8_t*)malloc(RANDOM_READ_MAX);
+    if (buf == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < n && ok; i++) {
+        int64_t addr, len;
+        chm_entry* e = random_piece(b, &seed, &addr, &len);
+        ok = chm_session_retrieve_entry(s, e, buf, addr, len) == len;
+        *bytes += len;
+    }
+    free(buf);
+    return ok;
+}
+
+static bool bench_random(struct bench* b) {
+    chm_session* s = chm_session_new(&b->f);
+    if (s == NULL) {
+        return false;
+    }
+    bool ok = random_reads(b, s, 1, config_random_ops, &b->bytes);
+    chm_session_free(s);
+    b->ops = config_random_ops;
+    return ok;
+}
+
+/* the pieces of bench_random() with one chm_retrieve_batch() */
+static bool bench_batch(struct bench* b) {
+    int n = config_random_ops;
+    chm_retrieve_request* reqs =
+        (chm_retrieve_request*)calloc((size_t)n, sizeof(chm_retrieve_request));
+    if (reqs == NULL) {
+        return false;
+    }
+    uint32_t seed = 1;
+    for (int i = 0; i < n; i++) {
+        reqs[i].entry = random_piece(b, &seed, &reqs[i].addr, &reqs[i].len);
+        b->bytes += reqs[i].len;
+    }
+    uint8_t* buf = (uint8_t*)malloc((size_t)b->bytes + 1);
+    bool ok = buf != NULL;
+    for (int i = 0, off = 0; ok && i < n; off += (int)reqs[i].len, i++) {
+        reqs[i].buf = buf + off;
+    }
+    ok = ok && chm_retrieve_batch(&b->f, reqs, n, b->n_threads);
+    free(buf);
+    free(reqs);
+    b->ops = n;
+    return ok;
+}
+
+struct bench_thread {
+    struct bench* b;
+    pthread_t tid;
+    uint32_t seed;
+    int64_t bytes;
+    bool ok;
+};
+
+static void* random_thread(void* param) {
+    struct bench_thread* t = (struct bench_thread*)param;
+    chm_session* s = chm_session_new(&t->b->f);
+    t->ok = s != NULL && random_reads(t->b, s, t->seed, config_random_ops, &t->bytes);
+    chm_session_free(s);
+    return NULL;
+}
+
+/* every thread does as much as bench_random(), with its own session */
+static bool bench_threads(struct bench* b) {
+    struct bench_thread* threads =
+        (struct bench_thread*)calloc((size_t)b->n_threads, sizeof(struct bench_thread));
+    if (threads == NULL) {
+        return false;
+    }
+    int nStarted = 0;
+    for (; nStarted < b->n_threads; nStarted++) {
+        struct bench_thread* t = &threads[nStarted];
+        t->b = b;
+        t->seed = (uint32_t)nStarted + 1;
+        if (pthread_create(&t->tid, NULL, random_thread, t) != 0) {
+            break;
+        }
+    }
+    bool ok = nStarted == b->n_threads;
+    for (int i = 0; i < nStarted; i++) {
+        pthread_join(threads[i].tid, NULL);
+        ok = ok && threads[i].ok;
+        b->bytes += threads[i].bytes;
+    }
+    free(threads);
+    b->ops = (int64_t)config_random_ops * b->n_threads;
+    return ok;
+}
+
+/* copy the compressed content of the first blocks, so the lzx benchmark
+ * times nothing but the decoder */
+static bool capture_blocks(struct bench* b) {
+    chm_file* f = &b->base;
+    if (!f->compression_enabled || f->cn_unit == NULL || f->n_reset_offsets == 0) {
+        return false;
+    }
+    int n = f->n_reset_offsets < LZX_MAX_BLOCKS ? (int)f->n_reset_offsets : LZX_MAX_BLOCKS;
+    int64_t end = n < f->n_reset_offsets ? f->reset_offsets[n] : f->reset_table.compressed_len;
+    int64_t len = end - f->reset_offsets[0];
+    int64_t off = (int64_t)f->itsf.data_offset + f->cn_unit->start + f->reset_offsets[0];
+    if (off < 0 || len < 0 || len > b->ctx.mem.size - off) {
+        return false;
+    }
+
+    /* the decoder may read a little past the end of its input */
+    b->lzx_in = (uint8_t*)calloc(1, (size_t)len + 6144);
+    b->lzx_offsets = (int64_t*)malloc(((size_t)n + 1) * sizeof(int64_t));
+    if (b->lzx_in == NULL || b->lzx_offsets == NULL) {
+        return false;
+    }
+    memcpy(b->lzx_in, (const uint8_t*)b->ctx.mem.data + off, (size_t)len);
+    for (int i = 0; i < n; i++) {
+        b->lzx_offsets[i] = f->reset_offsets[i] - f->reset_offsets[0];
+    }
+    b->lzx_offsets[n] = len;
+    b->lzx_blocks = n;
+    return true;
+}
+
+static bool bench_lzx(struct bench* b) {
+    chm_file* f = &b->base;
+    int window = 0;
+    while ((1u << (window + 1)) <= f->window_size) {
+        window++;
+    }
+    int64_t blockLen = f->reset_table.block_len;
+    struct lzx_state* state = lzx_init(window);
+    uint8_t* out = (uint8_t*)malloc((size_t)blockLen);
+    bool ok = state != NULL && out != NULL;
+    for (int i = 0; i < b->lzx_blocks && ok; i++) {
+        if (i % (int)f->reset_blkcount == 0) {
+            lzx_reset(state);
+        }
+        uint8_t* in = b->lzx_in + b->lzx_offsets[i];
+        int inLen = (int)(b->lzx_offsets[i + 1] - b->lzx_offsets[i]);
+        ok = lzx_decompress(state, in, out, inLen, (int)blockLen) == DECR_OK;
+    }
+    if (state != NULL) {
+        lzx_teardown(state);
+    }
+    free(out);
+    b->ops = b->lzx_blocks;
+    b->bytes = b->lzx_blocks * blockLen;
+    return ok;
+}
+
+static void bench_file(const char* path, int maxThreads) {
+    static const int cacheSizes[] = {16, 128, 1024, 8192};
+    struct bench b;
+    char param[64];
+
+    memset(&b, 0, sizeof(b));
+    b.path = path;
+    if (!mmap_reader_init(&b.ctx, path)) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return;
+    }
+
+    run_bench(&b, "parse", "", false, bench_parse);
+    run_bench(&b, "parse_lazy", "", false, bench_parse_lazy);
+
+    /* the rest works on the entries of an archive parsed once */
+    if (!chm_parse(&b.base, mmap_reader, &b.ctx)) {
+        fprintf(stderr, "%s: chm_parse() failed\n", path);
+        mmap_reader_close(&b.ctx);
+        return;
+    }
+    b.files = (chm_entry**)malloc(((size_t)b.base.n_entries + 1) * sizeof(chm_entry*));
+    for (int i = 0; b.files != NULL && i < b.base.n_entries; i++) {
+        chm_entry* e = &b.base.entries[i];
+        if ((e->flags & CHM_ENUMERATE_FILES) && e->length > 0) {
+            b.files[b.n_files++] = e;
+        }
+    }
+    bool haveBlocks = capture_blocks(&b);
+    if (b.n_files > 0) {
+        run_bench(&b, "lookup", "", false, bench_lookup);
+    }
+    if (haveBlocks) {
+        run_bench(&b, "lzx", "", false, bench_lzx);
+    }
+
+    run_bench(&b, "extract", "", true, bench_extract);
+    for (int n = 2; n <= maxThreads; n *= 2) {
+        b.n_threads = n;
+        snprintf(param, sizeof(param), "threads=%d", n);
+        run_bench(&b, "extract_parallel", param, true, bench_extract_parallel);
+    }
+
+    if (b.n_files > 0) {
+        for (size_t i = 0; i < sizeof(cacheSizes) / sizeof(cacheSizes[0]); i++) {
+            b.cache_blocks = cacheSizes[i];
+            snprintf(param, sizeof(param), "cache=%d", cacheSizes[i]);
+            run_bench(&b, "random", param, true, bench_random);
+        }
+        b.cache_blocks = 1024;
+        for (int n = 1; n <= maxThreads; n *= 2) {
+            b.n_threads = n;
+            snprintf(param, sizeof(param), "threads=%d,cache=%d", n, b.cache_blocks);
+            run_bench(&b, "random_threads", param, true, bench_threads);
+        }
+        /* batches don't depend on the cache */
+        b.cache_blocks = 0;
+        for (int n = 1; n <= maxThreads; n *= 2) {
+            b.n_threads = n;
+            snprintf(param, sizeof(param), "threads=%d", n);
+            run_bench(&b, "random_batch", param, true, bench_batch);
+        }
+    }
+
+    chm_close(&b.base);
+    free(b.files);
+    free(b.lzx_in);
+    free(b.lzx_offsets);
+    mmap_reader_close(&b.ctx);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [--reps=N] [--threads=N] [--random-ops=N] [--only=BENCH] <file>...\n",
+            argv0);
+}
+
+int main(int c, char** v) {
+    struct option longopts[] = {{"reps", required_argument, 0, 'r'},
+                                {"threads", required_argument, 0, 't'},
+                                {"random-ops", required_argument, 0, 'n'},
+                                {"only", required_argument, 0, 'o'},
+                                {"help", no_argument, 0, 'h'},
+                                {0, 0, 0, 0}};
+
+    while (1) {
+        int o = getopt_long(c, v, "r:t:n:o:h", longopts, NULL);
+        if (o < 0) {
+            break;
+        }
+        switch (o) {
+            case 'r':
+                config_reps = atoi(optarg);
+                if (config_reps <= 0 || config_reps > MAX_REPS) {
+                    fprintf(stderr, "bad number of repetitions (%s)\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 't':
+                config_threads = atoi(optarg);
+                if (config_threads <= 0) {
+                    fprintf(stderr, "bad number of threads (%s)\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'n':
+                config_random_ops = atoi(optarg);
+                if (config_random_ops <= 0) {
+                    fprintf(stderr, "bad number of random reads (%s)\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                config_only = optarg;
+                break;
+
+            default:
+                usage(v[0]);
+                return 1;
+        }
+    }
+    if (optind >= c) {
+        usage(v[0]);
+        return 1;
+    }
+
+    int maxThreads = config_threads;
+    if (maxThreads <= 0) {
+        maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (int i = optind; i < c; i++) {
+        bench_file(v[i], maxThreads);
+    }
+    return 0;
+}
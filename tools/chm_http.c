@@ -31,7 +31,17 @@ j *              in fact, probably badly broken for any serious usage.      *
 /* standard system includes */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /* includes for networking */
 #include <sys/socket.h>
@@ -39,6 +49,29 @@ j *              in fact, probably badly broken for any serious usage.      *
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+/* includes for the event loop */
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#define USE_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#include <sys/event.h>
+#define USE_KQUEUE
+#else
+#error "chm_http needs epoll or kqueue"
+#endif
+
+/* compressed responses, see acquire_packed() */
+#ifdef CHM_HTTP_GZIP
+#include <zlib.h>
+#endif
+#ifdef CHM_HTTP_BROTLI
+#include <brotli/encode.h>
+#endif
+#if defined(CHM_HTTP_GZIP) || defined(CHM_HTTP_BROTLI)
+#define HTTP_COMPRESS
+#endif
+
 /* threading includes */
 #include <pthread.h>
 
@@ -46,12 +79,35 @@ j *              in fact, probably badly broken for any serious usage.      *
 
 static int config_port = 8080;
 static char config_bind[65536] = "0.0.0.0";
+static const char* config_index = NULL;
+static int config_threads = 0;
+#ifndef CHM_HTTP_SIMPLE
+static const char* config_root = NULL;
+static int config_max_open = 64;
+#endif
+static int config_cache_mb = 64;
+static bool config_cache_mb_set = false;
+#ifdef HTTP_COMPRESS
+static int config_compress_mb = 32;
+#endif
+static int config_dedup_mb = 0;
+
+#ifdef HTTP_COMPRESS
+#define USAGE_COMPRESS " [--compress-mb=N]"
+#else
+#define USAGE_COMPRESS ""
+#endif
 
 static void usage(const char* argv0) {
 #ifdef CHM_HTTP_SIMPLE
     fprintf(stderr, "usage: %s <filename>\n", argv0);
 #else
-    fprintf(stderr, "usage: %s [--port=PORT] [--bind=IP] <filename>\n", argv0);
+    fprintf(stderr,
+            "usage: %s [--port=PORT] [--bind=IP] [--index=FILE] [--threads=N]\n"
+            "          [--cache-mb=N]" USAGE_COMPRESS " <filename>\n"
+            "       %s --root=DIR [--index=DIR] [--max-open=N] [--cache-mb=N]\n"
+            "          [--dedup-mb=N] [options]\n",
+            argv0, argv0);
 #endif
 }
 
@@ -73,12 +129,21 @@ int main(int c, char** v) {
 
     struct option longopts[] = {{"port", required_argument, 0, 'p'},
                                 {"bind", required_argument, 0, 'b'},
+                                {"index", required_argument, 0, 'i'},
+                                {"threads", required_argument, 0, 't'},
+                                {"root", required_argument, 0, 'r'},
+                                {"max-open", required_argument, 0, 'm'},
+                                {"cache-mb", required_argument, 0, 'c'},
+#ifdef HTTP_COMPRESS
+                                {"compress-mb", required_argument, 0, 'z'},
+#endif
+                                {"dedup-mb", required_argument, 0, 'd'},
                                 {"help", no_argument, 0, 'h'},
                                 {0, 0, 0, 0}};
 
     while (1) {
         int o;
-        o = getopt_long(c, v, "n:b:h", longopts, &optindex);
+        o = getopt_long(c, v, "n:b:i:t:r:m:c:z:d:h", longopts, &optindex);
         if (o < 0) {
             break;
         }
@@ -97,53 +162,915 @@ int main(int c, char** v) {
                 config_bind[65535] = '\0';
                 break;
 
+            case 'i':
+                config_index = optarg;
+                break;
+
+            case 't':
+                config_threads = atoi(optarg);
+                if (config_threads <= 0) {
+                    fprintf(stderr, "bad number of threads (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'r':
+                config_root = optarg;
+                break;
+
+            case 'm':
+                config_max_open = atoi(optarg);
+                if (config_max_open <= 0) {
+                    fprintf(stderr, "bad number of open archives (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'c':
+                config_cache_mb = atoi(optarg);
+                config_cache_mb_set = true;
+                if (config_cache_mb <= 0) {
+                    fprintf(stderr, "bad cache size (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
+#ifdef HTTP_COMPRESS
+            case 'z':
+                config_compress_mb = atoi(optarg);
+                if (config_compress_mb < 0) {
+                    fprintf(stderr, "bad compressed cache size (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+#endif
+
+            case 'd':
+                config_dedup_mb = atoi(optarg);
+                if (config_dedup_mb < 0) {
+                    fprintf(stderr, "bad dedup cache size (%s)\n", optarg);
+                    exit(1);
+                }
+                break;
+
             case 'h':
                 usage(v[0]);
                 break;
         }
     }
 
-    if (optind + 1 != c) {
+    /* with --root the archives are named in the URLs instead */
+    if (optind + (config_root ? 0 : 1) != c) {
         usage(v[0]);
+        return 1;
     }
 
     /* run the server */
-    res = chmhttp_server(v[optind]);
+    res = chmhttp_server(config_root ? NULL : v[optind]);
 #endif
 
     return res;
 }
 
+/* requests, with their headers, have to fit in this */
+#define HTTP_MAX_REQUEST 8192
+/* events handled per wakeup of a worker */
+#define MAX_EVENTS 64
+/* connections with no traffic for this long are closed */
+#define HTTP_IDLE_TIMEOUT_MS 30000
+/* how long a worker stops accepting when it's out of file descriptors */
+#define ACCEPT_BACKOFF_MS 100
+
+/* an open archive. Archives are shared by all workers and closed once they
+ * fall out of the open-archive LRU and no connection uses them any more */
+struct chmHttpArchive {
+    struct chmHttpArchive* prev;
+    struct chmHttpArchive* next;
+    char* name;
+    chm_file file;
+    mmap_reader_ctx mmap_ctx;
+    fd_reader_ctx fd_ctx;
+    /* the archive for sendfile(), or -1 when it's mapped into memory */
+    int file_fd;
+    /* chm_load_entries() can't run at the same time as lookups */
+    pthread_rwlock_t lock;
+    /* references held by requests and connections, under the server lock */
+    int refs;
+    /* estimate of the memory used by the directory, see archive_memory() */
+    int64_t memory;
+    /* one session per worker, each only used by its worker */
+    chm_session** sessions;
+};
+
+#ifdef HTTP_COMPRESS
+#define PACKED_BUCKETS 4096
+/* larger entries are always sent as they are, since they're compressed on the
+ * event loop */
+#define PACKED_MAX_ENTRY (1 << 20)
+
+enum { ENCODING_GZIP, ENCODING_BROTLI };
+
+/* an entry compressed for Content-Encoding */
+struct chmHttpPacked {
+    struct chmHttpPacked* hash_next;
+    struct chmHttpPacked* prev;
+    struct chmHttpPacked* next;
+    uint32_t hash;
+    /* the entry at start/length in the archive called archive */
+    char* archive;
+    int64_t start;
+    int64_t length;
+    int encoding;
+    /* NULL if compressing doesn't make the entry smaller */
+    uint8_t* data;
+    size_t len;
+    /* requests using it, and whether it's still in the cache */
+    int refs;
+    bool cached;
+    /* being compressed by a worker, which holds a reference to it. Requests
+     * get the plain entry meanwhile */
+    bool pending;
+};
+
+/* compressed entries, most recently used first, in at most max_bytes */
+struct chmHttpPackCache {
+    pthread_mutex_t lock;
+    struct chmHttpPacked* buckets[PACKED_BUCKETS];
+    struct chmHttpPacked* head;
+    struct chmHttpPacked* tail;
+    int64_t bytes;
+    int64_t max_bytes;
+    int64_t n_packed;
+    int64_t hits;
+    int64_t misses;
+};
+#endif
+
+/* bucket n of a latency histogram counts events that took under 2^n microseconds */
+#define LATENCY_BUCKETS 24
+
 struct chmHttpServer {
     int socket;
-    chm_file file;
+    int n_workers;
+    /* the archive given on the command line, or NULL when serving --root */
+    struct chmHttpArchive* single;
+
+    /* open archives of --root, most recently used first */
+    pthread_mutex_t lock;
+    struct chmHttpArchive* lru_head;
+    struct chmHttpArchive* lru_tail;
+    int n_open;
+    int64_t dir_memory;
+
+    /* latencies of reads and block decodes, see record_event() */
+    volatile int64_t latency[2][LATENCY_BUCKETS];
+
+#ifdef HTTP_COMPRESS
+    struct chmHttpPackCache packed;
+#endif
 };
 
-struct chmHttpSlave {
-    int fd;
+struct chmHttpWorker {
     struct chmHttpServer* server;
+    int id;
+    int poll_fd;
+    pthread_t tid;
+    /* the worker's connections, least recently active first */
+    struct chmHttpConn* conns_head;
+    struct chmHttpConn* conns_tail;
+    /* when to watch the listening socket again after accept() failed, or 0 */
+    int64_t accept_resume;
+};
+
+/* growable output buffer. failed is set if it couldn't grow */
+struct chmHttpBuf {
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+struct chmHttpConn {
+    struct chmHttpConn* prev;
+    struct chmHttpConn* next;
+    int fd;
+    /* when there was last traffic, see now_ms() */
+    int64_t last_active;
+    /* input not parsed yet, possibly several pipelined requests */
+    char in[HTTP_MAX_REQUEST];
+    size_t in_len;
+    bool eof;
+    /* response headers and generated bodies not written yet */
+    struct chmHttpBuf out;
+    size_t out_off;
+    /* part of an entry still to be sent after out, and the archive it's in,
+     * which the connection holds a reference to */
+    struct chmHttpArchive* archive;
+    chm_entry* body;
+    int64_t body_addr;
+    int64_t body_end;
+    /* close once the current response is written */
+    bool close_after;
+    /* waiting for the socket to be writable rather than readable */
+    bool want_write;
+};
+
+struct chmHttpRequest {
+    bool head;
+    bool keep_alive;
+    char* path;
+    /* header lines, each NUL terminated, see find_header() */
+    char* headers;
+    char* headers_end;
 };
 
-static void* _slave(void* param);
+static void* worker_main(void* param);
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* the event loop. Connections register with their chmHttpConn, the listening
+ * socket with NULL. A connection waits either for input or for room to write */
+#ifdef USE_EPOLL
+static int poller_new(void) {
+    return epoll_create1(0);
+}
+
+static int poller_ctl(int pfd, int op, int fd, void* ptr, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+    return epoll_ctl(pfd, op, fd, &ev);
+}
+
+static int poller_add_listener(int pfd, int fd) {
+    uint32_t events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    /* wake up one worker per connection, not all of them */
+    events |= EPOLLEXCLUSIVE;
+#endif
+    return poller_ctl(pfd, EPOLL_CTL_ADD, fd, NULL, events);
+}
+
+static int poller_add(int pfd, int fd, void* ptr) {
+    return poller_ctl(pfd, EPOLL_CTL_ADD, fd, ptr, EPOLLIN);
+}
+
+static int poller_watch(int pfd, int fd, void* ptr, bool write) {
+    return poller_ctl(pfd, EPOLL_CTL_MOD, fd, ptr, write ? EPOLLOUT : EPOLLIN);
+}
+
+static void poller_del(int pfd, int fd) {
+    poller_ctl(pfd, EPOLL_CTL_DEL, fd, NULL, 0);
+}
+
+static void poller_del_listener(int pfd, int fd) {
+    poller_del(pfd, fd);
+}
+
+/* wait at most timeout milliseconds, or forever if it's negative */
+static int poller_wait(int pfd, void** ptrs, int max, int timeout) {
+    struct epoll_event ev[MAX_EVENTS];
+    int n = epoll_wait(pfd, ev, max < MAX_EVENTS ? max : MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        ptrs[i] = ev[i].data.ptr;
+    }
+    return n;
+}
+#else
+static int poller_new(void) {
+    return kqueue();
+}
+
+static int poller_add_listener(int pfd, int fd) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent(pfd, &ev, 1, NULL, 0, NULL);
+}
+
+static int poller_add(int pfd, int fd, void* ptr) {
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD, 0, 0, ptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, ptr);
+    return kevent(pfd, ev, 2, NULL, 0, NULL);
+}
+
+static int poller_watch(int pfd, int fd, void* ptr, bool write) {
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, write ? EV_DISABLE : EV_ENABLE, 0, 0, ptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, write ? EV_ENABLE : EV_DISABLE, 0, 0, ptr);
+    return kevent(pfd, ev, 2, NULL, 0, NULL);
+}
+
+static void poller_del(int pfd, int fd) {
+    /* closing the socket removes its events */
+    (void)pfd;
+    (void)fd;
+}
+
+static void poller_del_listener(int pfd, int fd) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(pfd, &ev, 1, NULL, 0, NULL);
+}
+
+/* wait at most timeout milliseconds, or forever if it's negative */
+static int poller_wait(int pfd, void** ptrs, int max, int timeout) {
+    struct kevent ev[MAX_EVENTS];
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    int n = kevent(pfd, NULL, 0, ev, max < MAX_EVENTS ? max : MAX_EVENTS,
+                   timeout < 0 ? NULL : &ts);
+    for (int i = 0; i < n; i++) {
+        ptrs[i] = (void*)ev[i].udata;
+    }
+    return n;
+}
+#endif
+
+/* chm_event_func that adds ev to the server's latency histograms */
+static void record_event(void* ctx, const chm_event* ev) {
+    struct chmHttpServer* server = (struct chmHttpServer*)ctx;
+    int64_t us = ev->ns / 1000;
+    int n = 0;
+    while (us > 0 && n < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        n++;
+    }
+    __atomic_add_fetch(&server->latency[ev->type == CHM_EVENT_DECODE][n], 1, __ATOMIC_RELAXED);
+}
+
+/* rough size of the parsed directory of an archive */
+static int64_t archive_memory(struct chmHttpArchive* a) {
+    chm_file* f = &a->file;
+    int64_t n = (int64_t)f->n_entries * (int64_t)sizeof(chm_entry) + f->dir_len;
+    if (f->path_index != NULL) {
+        n += ((int64_t)f->path_index_mask + 1) * (int64_t)sizeof(int32_t);
+    }
+    n += f->n_reset_offsets * (int64_t)sizeof(int64_t);
+    return n;
+}
+
+#ifndef CHM_HTTP_SIMPLE
+static void close_archive(struct chmHttpArchive* a, int nWorkers) {
+    for (int i = 0; i < nWorkers; i++) {
+        chm_session_free(a->sessions[i]);
+    }
+    chm_close(&a->file);
+    if (a->file_fd >= 0) {
+        fd_reader_close(&a->fd_ctx);
+    } else {
+        mmap_reader_close(&a->mmap_ctx);
+    }
+    pthread_rwlock_destroy(&a->lock);
+    free(a->sessions);
+    free(a->name);
+    free(a);
+}
+#endif
+
+/* open the archive at path. With lazy set and no index the directory is only
+ * read as far as needed, see chm_parse_lazy() */
+static struct chmHttpArchive* open_archive(const char* path, const char* name,
+                                           const char* indexPath, bool lazy,
+                                           struct chmHttpServer* server) {
+    chm_reader reader;
+    void* ctx;
+
+    struct chmHttpArchive* a = (struct chmHttpArchive*)calloc(1, sizeof(struct chmHttpArchive));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->name = strdup(name);
+    a->sessions = (chm_session**)calloc((size_t)server->n_workers, sizeof(chm_session*));
+    if (a->name == NULL || a->sessions == NULL) {
+        goto Error;
+    }
+
+    /* serve straight from a mapping if possible, else from the file with sendfile() */
+    if (mmap_reader_init(&a->mmap_ctx, path)) {
+        reader = mmap_reader;
+        ctx = &a->mmap_ctx;
+        a->file_fd = -1;
+    } else if (fd_reader_init(&a->fd_ctx, path)) {
+        reader = fd_reader;
+        ctx = &a->fd_ctx;
+        a->file_fd = a->fd_ctx.fd;
+    } else {
+        goto Error;
+    }
+
+    bool ok;
+    struct stat st;
+    if (indexPath != NULL && stat(path, &st) == 0) {
+        /* use the index if it's still valid, otherwise write a fresh one */
+        ok = chm_index_load(&a->file, reader, ctx, indexPath, st.st_size, st.st_mtime);
+        if (!ok && chm_parse(&a->file, reader, ctx)) {
+            ok = true;
+            if (!chm_index_save(&a->file, indexPath, st.st_size, st.st_mtime)) {
+                fprintf(stderr, "couldn't write index '%s'\n", indexPath);
+            }
+        }
+    } else if (lazy) {
+        ok = chm_parse_lazy(&a->file, reader, ctx);
+    } else {
+        ok = chm_parse(&a->file, reader, ctx);
+    }
+    if (!ok) {
+        if (a->file_fd >= 0) {
+            fd_reader_close(&a->fd_ctx);
+        } else {
+            mmap_reader_close(&a->mmap_ctx);
+        }
+        goto Error;
+    }
+    pthread_rwlock_init(&a->lock, NULL);
+    a->memory = archive_memory(a);
+    chm_set_event_hook(&a->file, record_event, server);
+    return a;
+
+Error:
+    free(a->sessions);
+    free(a->name);
+    free(a);
+    return NULL;
+}
+
+/* the worker's session for archive a */
+static chm_session* archive_session(struct chmHttpWorker* w, struct chmHttpArchive* a) {
+    if (a->sessions[w->id] == NULL) {
+        a->sessions[w->id] = chm_session_new(&a->file);
+    }
+    return a->sessions[w->id];
+}
+
+static chm_entry* archive_find(struct chmHttpArchive* a, const char* path) {
+    pthread_rwlock_rdlock(&a->lock);
+    chm_entry* e = chm_find_entry_nocase(&a->file, path);
+    pthread_rwlock_unlock(&a->lock);
+    return e;
+}
+
+#ifndef CHM_HTTP_SIMPLE
+static void lru_unlink(struct chmHttpServer* server, struct chmHttpArchive* a) {
+    if (a->prev) {
+        a->prev->next = a->next;
+    } else {
+        server->lru_head = a->next;
+    }
+    if (a->next) {
+        a->next->prev = a->prev;
+    } else {
+        server->lru_tail = a->prev;
+    }
+    a->prev = a->next = NULL;
+}
+
+static void lru_push(struct chmHttpServer* server, struct chmHttpArchive* a) {
+    a->prev = NULL;
+    a->next = server->lru_head;
+    if (server->lru_head) {
+        server->lru_head->prev = a;
+    } else {
+        server->lru_tail = a;
+    }
+    server->lru_head = a;
+}
+
+/* close unused archives, least recently used first, until no more than
+ * --max-open are open and their directories take at most half of --cache-mb,
+ * then split the rest of it evenly between their block caches. Called with the
+ * server lock held */
+static void trim_archives(struct chmHttpServer* server) {
+    int64_t budget = (int64_t)config_cache_mb << 20;
+    struct chmHttpArchive* a = server->lru_tail;
+    while (a != NULL && (server->n_open > config_max_open || server->dir_memory > budget / 2)) {
+        struct chmHttpArchive* prev = a->prev;
+        if (a->refs == 0) {
+            lru_unlink(server, a);
+            server->n_open--;
+            server->dir_memory -= a->memory;
+            close_archive(a, server->n_workers);
+        }
+        a = prev;
+    }
+    if (server->n_open == 0) {
+        return;
+    }
+    int64_t share = (budget - server->dir_memory) / server->n_open;
+    for (a = server->lru_head; a != NULL; a = a->next) {
+        chm_set_cache_bytes(&a->file, share > 0 ? share : 0);
+    }
+}
+
+/* is name a plain file name that can't escape the --root directory? */
+static bool valid_archive_name(const char* name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL &&
+           strchr(name, '\\') == NULL;
+}
+
+/* find the archive called name in --root, opening it if needed, and take a
+ * reference */
+static struct chmHttpArchive* acquire_root_archive(struct chmHttpServer* server,
+                                                   const char* name) {
+    struct chmHttpArchive* a;
+
+    if (!valid_archive_name(name)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    for (a = server->lru_head; a != NULL; a = a->next) {
+        if (strcmp(a->name, name) == 0) {
+            a->refs++;
+            lru_unlink(server, a);
+            lru_push(server, a);
+            pthread_mutex_unlock(&server->lock);
+            return a;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    /* open it without holding up the other workers */
+    char path[4096];
+    char indexPath[4096];
+    snprintf(path, sizeof(path), "%s/%s", config_root, name);
+    if (config_index != NULL) {
+        snprintf(indexPath, sizeof(indexPath), "%s/%s.idx", config_index, name);
+    }
+    struct chmHttpArchive* opened =
+        open_archive(path, name, config_index ? indexPath : NULL, true, server);
+    if (opened == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    /* another worker may have opened it in the meantime */
+    for (a = server->lru_head; a != NULL; a = a->next) {
+        if (strcmp(a->name, name) == 0) {
+            break;
+        }
+    }
+    if (a == NULL) {
+        a = opened;
+        opened = NULL;
+        lru_push(server, a);
+        server->n_open++;
+        server->dir_memory += a->memory;
+    }
+    a->refs++;
+    trim_archives(server);
+    pthread_mutex_unlock(&server->lock);
+
+    if (opened != NULL) {
+        close_archive(opened, server->n_workers);
+    }
+    return a;
+}
+#endif
+
+/* find the archive called name, opening it if needed, and take a reference */
+static struct chmHttpArchive* acquire_archive(struct chmHttpServer* server, const char* name) {
+#ifdef CHM_HTTP_SIMPLE
+    (void)name;
+#else
+    if (server->single == NULL) {
+        return acquire_root_archive(server, name);
+    }
+#endif
+    struct chmHttpArchive* a = server->single;
+    pthread_mutex_lock(&server->lock);
+    a->refs++;
+    pthread_mutex_unlock(&server->lock);
+    return a;
+}
+
+static void release_archive(struct chmHttpServer* server, struct chmHttpArchive* a) {
+    if (a == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&server->lock);
+    a->refs--;
+#ifndef CHM_HTTP_SIMPLE
+    if (a->refs == 0 && server->single == NULL) {
+        /* it may have been kept open past the limits while in use */
+        trim_archives(server);
+    }
+#endif
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* listing an archive needs all of its entries. Always takes the write lock,
+ * entries are only safe to look at under the lock */
+static void archive_load_entries(struct chmHttpServer* server, struct chmHttpArchive* a) {
+    pthread_rwlock_wrlock(&a->lock);
+    bool loaded = a->file.entries == NULL;
+    chm_load_entries(&a->file);
+    pthread_rwlock_unlock(&a->lock);
+    if (!loaded) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    int64_t memory = archive_memory(a);
+    if (server->single == NULL) {
+        server->dir_memory += memory - a->memory;
+    }
+    a->memory = memory;
+    pthread_mutex_unlock(&server->lock);
+}
+
+#ifdef HTTP_COMPRESS
+/* rough hash of the entry at start/length in the archive called name */
+static uint32_t packed_hash(const char* name, chm_entry* e, int encoding) {
+    uint32_t h = 2166136261u;
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    h = (h ^ (uint32_t)e->start) * 16777619u;
+    h = (h ^ (uint32_t)(e->start >> 32)) * 16777619u;
+    h = (h ^ (uint32_t)e->length) * 16777619u;
+    return (h ^ (uint32_t)encoding) * 16777619u;
+}
+
+static bool packed_is(struct chmHttpPacked* p, uint32_t hash, const char* name, chm_entry* e,
+                      int encoding) {
+    return p->hash == hash && p->start == e->start && p->length == e->length &&
+           p->encoding == encoding && strcmp(p->archive, name) == 0;
+}
+
+static void packed_free(struct chmHttpPacked* p) {
+    free(p->data);
+    free(p->archive);
+    free(p);
+}
+
+static int64_t packed_size(struct chmHttpPacked* p) {
+    return (int64_t)(sizeof(struct chmHttpPacked) + strlen(p->archive) + 1 + p->len);
+}
+
+static void packed_unlink(struct chmHttpPackCache* pc, struct chmHttpPacked* p) {
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        pc->head = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    } else {
+        pc->tail = p->prev;
+    }
+    p->prev = p->next = NULL;
+}
+
+static void packed_push(struct chmHttpPackCache* pc, struct chmHttpPacked* p) {
+    p->prev = NULL;
+    p->next = pc->head;
+    if (pc->head) {
+        pc->head->prev = p;
+    } else {
+        pc->tail = p;
+    }
+    pc->head = p;
+}
+
+/* drop p from the cache. It's freed once nobody uses it */
+static void packed_evict(struct chmHttpPackCache* pc, struct chmHttpPacked* p) {
+    struct chmHttpPacked** link = &pc->buckets[p->hash % PACKED_BUCKETS];
+    while (*link != p) {
+        link = &(*link)->hash_next;
+    }
+    *link = p->hash_next;
+    packed_unlink(pc, p);
+    pc->bytes -= packed_size(p);
+    pc->n_packed--;
+    p->cached = false;
+    if (p->refs == 0) {
+        packed_free(p);
+    }
+}
+
+#ifdef CHM_HTTP_GZIP
+static bool gzip_compress(const uint8_t* in, size_t len, uint8_t** out, size_t* outLen) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    size_t cap = deflateBound(&z, (uLong)len);
+    *out = (uint8_t*)malloc(cap);
+    int res = Z_MEM_ERROR;
+    if (*out != NULL) {
+        z.next_in = (Bytef*)in;
+        z.avail_in = (uInt)len;
+        z.next_out = *out;
+        z.avail_out = (uInt)cap;
+        res = deflate(&z, Z_FINISH);
+        *outLen = z.total_out;
+    }
+    deflateEnd(&z);
+    if (res != Z_STREAM_END) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef CHM_HTTP_BROTLI
+static bool brotli_compress(const uint8_t* in, size_t len, uint8_t** out, size_t* outLen) {
+    *outLen = BrotliEncoderMaxCompressedSize(len);
+    *out = (uint8_t*)malloc(*outLen);
+    if (*out == NULL) {
+        return false;
+    }
+    if (!BrotliEncoderCompress(7, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, in, outLen,
+                               *out)) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+    return true;
+}
+#endif
+
+/* compress the whole of e, which is in archive a. out is set to NULL if that
+ * doesn't make it smaller */
+static bool pack_entry(struct chmHttpWorker* w, struct chmHttpArchive* a, chm_entry* e,
+                       int encoding, uint8_t** out, size_t* outLen) {
+    chm_session* session = archive_session(w, a);
+    uint8_t* data = (uint8_t*)malloc((size_t)e->length);
+    if (session == NULL || data == NULL ||
+        chm_session_retrieve_entry(session, e, data, 0, e->length) != e->length) {
+        free(data);
+        return false;
+    }
+
+    bool ok = false;
+    *out = NULL;
+    *outLen = 0;
+#ifdef CHM_HTTP_GZIP
+    if (encoding == ENCODING_GZIP) {
+        ok = gzip_compress(data, (size_t)e->length, out, outLen);
+    }
+#endif
+#ifdef CHM_HTTP_BROTLI
+    if (encoding == ENCODING_BROTLI) {
+        ok = brotli_compress(data, (size_t)e->length, out, outLen);
+    }
+#endif
+    free(data);
+    /* remember entries that don't get smaller, so they're not tried again */
+    if (!ok || *outLen >= (size_t)e->length) {
+        free(*out);
+        *out = NULL;
+        *outLen = 0;
+    }
+    return true;
+}
+
+static void release_packed(struct chmHttpServer* server, struct chmHttpPacked* p) {
+    struct chmHttpPackCache* pc = &server->packed;
+    pthread_mutex_lock(&pc->lock);
+    p->refs--;
+    if (p->refs == 0 && !p->cached) {
+        packed_free(p);
+    }
+    pthread_mutex_unlock(&pc->lock);
+}
+/* find e compressed with encoding, compressing it if it isn't cached yet, and
+ * take a reference to it. Returns NULL if it couldn't be compressed or another
+ * worker is compressing it */
+static struct chmHttpPacked* acquire_packed(struct chmHttpWorker* w, struct chmHttpArchive* a,
+                                            chm_entry* e, int encoding) {
+    struct chmHttpPackCache* pc = &w->server->packed;
+    uint32_t hash = packed_hash(a->name, e, encoding);
+    struct chmHttpPacked* p;
+
+    pthread_mutex_lock(&pc->lock);
+    for (p = pc->buckets[hash % PACKED_BUCKETS]; p != NULL; p = p->hash_next) {
+        if (packed_is(p, hash, a->name, e, encoding)) {
+            break;
+        }
+    }
+    if (p != NULL && !p->pending) {
+        p->refs++;
+        pc->hits++;
+        packed_unlink(pc, p);
+        packed_push(pc, p);
+        pthread_mutex_unlock(&pc->lock);
+        return p;
+    }
+    pc->misses++;
+    /* p is pending. Other entries need to leave room for plenty of others */
+    if (p != NULL || e->length > PACKED_MAX_ENTRY || e->length > pc->max_bytes / 8) {
+        pthread_mutex_unlock(&pc->lock);
+        return NULL;
+    }
+
+    /* claim it, so concurrent requests for it don't compress it too */
+    p = (struct chmHttpPacked*)calloc(1, sizeof(struct chmHttpPacked));
+    char* archive = strdup(a->name);
+    if (p == NULL || archive == NULL) {
+        pthread_mutex_unlock(&pc->lock);
+        free(archive);
+        free(p);
+        return NULL;
+    }
+    p->hash = hash;
+    p->archive = archive;
+    p->start = e->start;
+    p->length = e->length;
+    p->encoding = encoding;
+    p->refs = 1;
+    p->cached = true;
+    p->pending = true;
+    p->hash_next = pc->buckets[hash % PACKED_BUCKETS];
+    pc->buckets[hash % PACKED_BUCKETS] = p;
+    packed_push(pc, p);
+    pc->bytes += packed_size(p);
+    pc->n_packed++;
+    pthread_mutex_unlock(&pc->lock);
+
+    uint8_t* data;
+    size_t len;
+    bool ok = pack_entry(w, a, e, encoding, &data, &len);
+
+    pthread_mutex_lock(&pc->lock);
+    p->pending = false;
+    if (ok) {
+        p->data = data;
+        p->len = len;
+        if (p->cached) {
+            pc->bytes += (int64_t)len;
+            while (pc->bytes > pc->max_bytes && pc->tail != p) {
+                packed_evict(pc, pc->tail);
+            }
+        }
+    } else if (p->cached) {
+        /* don't keep failures, they may not happen again */
+        packed_evict(pc, p);
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    if (!ok) {
+        release_packed(w->server, p);
+        return NULL;
+    }
+    return p;
+}
+#endif
 
 static int chmhttp_server(const char* path) {
     struct chmHttpServer server;
-    struct chmHttpSlave* slave;
+    struct chmHttpWorker* workers;
     struct sockaddr_in bindAddr;
-    socklen_t addrLen;
-    pthread_t tid;
     int one = 1;
 
-    fd_reader_ctx ctx;
-    if (!fd_reader_init(&ctx, path)) {
-        fprintf(stderr, "failed to open %s\n", path);
-        return 1;
+    memset(&server, 0, sizeof(server));
+    pthread_mutex_init(&server.lock, NULL);
+    /* versions of the same documentation share the blocks they have in common,
+     * on top of the --cache-mb the archives' own caches get */
+    if (config_dedup_mb > 0) {
+        chm_set_dedup_bytes((int64_t)config_dedup_mb << 20);
     }
-    bool ok = chm_parse(&server.file, fd_reader, &ctx);
-    if (!ok) {
-        fprintf(stderr, "couldn't open file '%s'\n", path);
-        fd_reader_close(&ctx);
-        return 2;
+#ifdef HTTP_COMPRESS
+    pthread_mutex_init(&server.packed.lock, NULL);
+    server.packed.max_bytes = (int64_t)config_compress_mb << 20;
+#endif
+
+    /* one worker per core, each with its own event loop */
+    server.n_workers = config_threads;
+    if (server.n_workers <= 0) {
+        server.n_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (server.n_workers <= 0) {
+        server.n_workers = 1;
+    }
+
+    if (path != NULL) {
+        const char* name = strrchr(path, '/');
+        server.single = open_archive(path, name ? name + 1 : path, config_index, false, &server);
+        if (server.single == NULL) {
+            fprintf(stderr, "couldn't open file '%s'\n", path);
+            return 2;
+        }
+        /* never closed */
+        server.single->refs = 1;
+        if (config_cache_mb_set) {
+            chm_set_cache_bytes(&server.single->file, (int64_t)config_cache_mb << 20);
+        }
     }
 
     server.socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -165,53 +1092,98 @@ static int chmhttp_server(const char* path) {
     }
 
     /* listen for connections */
-    listen(server.socket, 75);
-    addrLen = sizeof(struct sockaddr);
-    while (1) {
-        slave = (struct chmHttpSlave*)malloc(sizeof(struct chmHttpSlave));
-        slave->server = &server;
-        slave->fd = accept(server.socket, (struct sockaddr*)&bindAddr, &addrLen);
-        if (slave->fd == -1)
-            break;
+    if (listen(server.socket, SOMAXCONN) < 0 || !set_nonblocking(server.socket)) {
+        perror("listen");
+        return 3;
+    }
+
+    /* writes to clients that went away fail with EPIPE instead */
+    signal(SIGPIPE, SIG_IGN);
 
-        pthread_create(&tid, NULL, _slave, (void*)slave);
-        pthread_detach(tid);
+    workers = (struct chmHttpWorker*)calloc((size_t)server.n_workers, sizeof(struct chmHttpWorker));
+    if (workers == NULL) {
+        return 4;
+    }
+    int nStarted = 0;
+    for (int i = 0; i < server.n_workers; i++) {
+        struct chmHttpWorker* w = &workers[i];
+        w->server = &server;
+        w->id = i;
+        w->poll_fd = poller_new();
+        if (w->poll_fd < 0 || poller_add_listener(w->poll_fd, server.socket) < 0 ||
+            pthread_create(&w->tid, NULL, worker_main, w) != 0) {
+            perror("chm_http: failed to start worker");
+            if (w->poll_fd >= 0) {
+                close(w->poll_fd);
+            }
+            w->poll_fd = -1;
+            continue;
+        }
+        nStarted++;
     }
-    free(slave);
+    if (nStarted == 0) {
+        return 4;
+    }
+    for (int i = 0; i < server.n_workers; i++) {
+        if (workers[i].poll_fd >= 0) {
+            pthread_join(workers[i].tid, NULL);
+        }
+    }
+    free(workers);
     return 0;
 }
 
-static void service_request(int fd, struct chm_file* file);
-
-static void* _slave(void* param) {
-    struct chmHttpSlave* slave;
-    struct chm_file* file;
-
-    /* grab our relevant information */
-    slave = (struct chmHttpSlave*)param;
-    file = &slave->server->file;
-
-    /* handle request */
-    service_request(slave->fd, file);
+static bool buf_reserve(struct chmHttpBuf* b, size_t n) {
+    if (b->failed) {
+        return false;
+    }
+    if (b->len + n <= b->cap) {
+        return true;
+    }
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+    char* data = (char*)realloc(b->data, cap);
+    if (data == NULL) {
+        b->failed = true;
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
 
-    /* free our resources and return */
-    close(slave->fd);
-    free(slave);
-    return NULL;
+static void buf_append(struct chmHttpBuf* b, const char* d, size_t len) {
+    if (buf_reserve(b, len)) {
+        memcpy(b->data + b->len, d, len);
+        b->len += len;
+    }
 }
 
-static const char CONTENT_404[] =
-    "HTTP/1.1 404 File not found\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>404 File Not Found</title></head><body><h1>404 "
-    "File not found</h1></body></html>\r\n";
-static const char CONTENT_500[] =
-    "HTTP/1.1 500 Unknown thing\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>500 Unknown thing</title></head><body><h1>500 "
-    "Unknown thing</h1></body></html>\r\n";
-static const char INTERNAL_ERROR[] =
-    "HTTP/1.1 500 Internal error\r\nConnection: close\r\nContent-Type: text/html; "
-    "charset=iso-8859-1\r\n\r\n<html><head><title>500 Unknown thing</title></head><body><h1>500 "
-    "Server error</h1></body></html>\r\n";
+static void buf_printf(struct chmHttpBuf* b, const char* fmt, ...) {
+    if (!buf_reserve(b, 256)) {
+        return;
+    }
+    while (1) {
+        size_t room = b->cap - b->len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            b->failed = true;
+            return;
+        }
+        if ((size_t)n < room) {
+            b->len += (size_t)n;
+            return;
+        }
+        if (!buf_reserve(b, (size_t)n + 1)) {
+            return;
+        }
+    }
+}
 
 struct mime_mapping {
     const char* ext;
@@ -238,116 +1210,886 @@ static const char* lookup_mime(const char* ext) {
     return "application/octet-stream";
 }
 
-static void print_entry_index(FILE* fout, chm_entry* e) {
-    fprintf(fout,
-            "<tr>"
-            "<td align=right>%8d\n</td>"
-            "<td><a href=\"%s\">%s</a></td>"
-            "</tr>",
-            (int)e->length, e->path, e->path);
+/* the value of header name in req, or NULL */
+static const char* find_header(struct chmHttpRequest* req, const char* name) {
+    size_t nameLen = strlen(name);
+    for (char* p = req->headers; p < req->headers_end; p += strlen(p) + 1) {
+        if (strncasecmp(p, name, nameLen) == 0 && p[nameLen] == ':') {
+            p += nameLen + 1;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* does the comma separated list value contain token? */
+static bool has_token(const char* value, const char* token) {
+    size_t tokenLen = strlen(token);
+    while (value != NULL && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t len = strcspn(value, ", \t");
+        if (len == tokenLen && strncasecmp(value, token, len) == 0) {
+            return true;
+        }
+        value += len;
+    }
+    return false;
+}
+
+/* does the If-None-Match value list etag? Tags compare weakly, as it requires */
+static bool etag_matches(const char* value, const char* etag) {
+    size_t tagLen = strlen(etag);
+    while (value != NULL && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        if (*value == '*') {
+            return true;
+        }
+        if (strncmp(value, "W/", 2) == 0) {
+            value += 2;
+        }
+        size_t len = strcspn(value, ", \t");
+        if (len == tagLen && strncmp(value, etag, len) == 0) {
+            return true;
+        }
+        value += len;
+    }
+    return false;
+}
+
+static bool parse_int64(const char** s, int64_t* v) {
+    const char* p = *s;
+    *v = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (*v > (INT64_MAX - 9) / 10) {
+            return false;
+        }
+        *v = *v * 10 + (*p - '0');
+    }
+    if (p == *s) {
+        return false;
+    }
+    *s = p;
+    return true;
+}
+
+/* parse a Range header for an entry of length bytes into the bytes first to
+ * last inclusive. Returns 1 for a range, 0 if the whole entry should be sent
+ * instead and -1 if the range can't be satisfied. Only single ranges are
+ * supported, anything else gets the whole entry */
+static int parse_range(const char* value, int64_t length, int64_t* first, int64_t* last) {
+    int64_t n;
+
+    if (value == NULL || strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    const char* p = value + 6;
+    if (*p == '-') {
+        /* the last n bytes */
+        p++;
+        if (!parse_int64(&p, &n)) {
+            return 0;
+        }
+        if (n == 0 || length == 0) {
+            return -1;
+        }
+        *first = n < length ? length - n : 0;
+        *last = length - 1;
+    } else {
+        if (!parse_int64(&p, first) || *p++ != '-') {
+            return 0;
+        }
+        *last = length - 1;
+        if (*p >= '0' && *p <= '9') {
+            if (!parse_int64(&p, &n) || n < *first) {
+                return 0;
+            }
+            if (n < *last) {
+                *last = n;
+            }
+        }
+        if (*first >= length) {
+            return -1;
+        }
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return *p == '\0' ? 1 : 0;
+}
+
+#ifdef HTTP_COMPRESS
+/* does the Accept-Encoding value allow the content coding name? */
+static bool accepts_encoding(const char* value, const char* name) {
+    size_t nameLen = strlen(name);
+    while (value != NULL && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        size_t len = strcspn(value, ",; \t");
+        bool match = len == nameLen && strncasecmp(value, name, len) == 0;
+        value += len;
+        /* of the parameters only q matters, and q=0 means no */
+        double q = 1;
+        while (*value && *value != ',') {
+            if (*value++ != ';') {
+                continue;
+            }
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            if ((*value == 'q' || *value == 'Q') && value[1] == '=') {
+                q = strtod(value + 2, NULL);
+            }
+        }
+        if (match) {
+            return q > 0;
+        }
+    }
+    return false;
 }
+#endif
 
-static void deliver_index(FILE* fout, struct chm_file* file) {
-    fprintf(fout,
-            "HTTP/1.1 200 OK\r\n"
-            "Connection: close\r\n"
-            /* "Content-Length: 1000000\r\n" */
-            "Content-Type: text/html\r\n\r\n"
+/* parse the request in s, which ends at end and is NUL terminated */
+static bool parse_request(char* s, char* end, struct chmHttpRequest* req) {
+    memset(req, 0, sizeof(*req));
 
-            "<h2><u>CHM contents:</u></h2>"
-            "<body><table>"
-            "<tr><td><h5>Size:</h5></td><td><h5>File:</h5></td></tr>"
-            "<tt>");
-    for (int i = 0; i < file->n_entries; i++) {
-        print_entry_index(fout, file->entries[i]);
+    /* split the header lines */
+    for (char* p = s; p < end; p++) {
+        if (*p == '\r' || *p == '\n') {
+            *p = '\0';
+        }
+    }
+    req->headers = s + strlen(s) + 1;
+    req->headers_end = end;
+    if (req->headers > end) {
+        req->headers = end;
     }
 
-    fprintf(fout, "</tt> </table></body></html>");
+    /* request line: method, path and version */
+    char* path = strchr(s, ' ');
+    if (path == NULL) {
+        return false;
+    }
+    *path++ = '\0';
+    char* version = strchr(path, ' ');
+    if (version != NULL) {
+        *version++ = '\0';
+    }
+    req->path = path;
+
+    if (strcmp(s, "HEAD") == 0) {
+        req->head = true;
+    } else if (strcmp(s, "GET") != 0) {
+        return false;
+    }
+
+    /* HTTP/1.1 connections stay open unless they ask otherwise, older ones the opposite */
+    const char* conn = find_header(req, "Connection");
+    if (version != NULL && strcmp(version, "HTTP/1.1") == 0) {
+        req->keep_alive = !has_token(conn, "close");
+    } else {
+        req->keep_alive = has_token(conn, "keep-alive");
+    }
+    return true;
+}
+
+/* extra holds any further header lines, each ending with CRLF */
+static void queue_headers(struct chmHttpConn* c, int status, const char* reason,
+                          const char* ctype, int64_t length, const char* extra) {
+    buf_printf(&c->out,
+               "HTTP/1.1 %d %s\r\n"
+               "Connection: %s\r\n"
+               "Content-Length: %lld\r\n"
+               "Content-Type: %s\r\n"
+               "%s\r\n",
+               status, reason, c->close_after ? "close" : "keep-alive", (long long)length,
+               ctype, extra);
 }
 
-static int streq(const char* s1, const char* s2) {
-    return strcasecmp(s1, s2) == 0;
+static void queue_error(struct chmHttpConn* c, bool head, int status, const char* reason) {
+    char body[256];
+    int len = snprintf(body, sizeof(body),
+                       "<html><head><title>%d %s</title></head><body><h1>%d %s</h1></body>"
+                       "</html>\r\n",
+                       status, reason, status, reason);
+    queue_headers(c, status, reason, "text/html; charset=iso-8859-1", len, "");
+    if (!head) {
+        buf_append(&c->out, body, (size_t)len);
+    }
 }
 
-static chm_entry* find_entry_by_path(chm_file* f, const char* path) {
-    chm_entry* e;
-    for (int i = 0; i < f->n_entries; i++) {
-        e = f->entries[i];
-        if (streq(e->path, path)) {
-            return e;
+static void print_entry_index(struct chmHttpBuf* b, const char* prefix, chm_entry* e) {
+    buf_printf(b,
+               "<tr>"
+               "<td align=right>%8d\n</td>"
+               "<td><a href=\"%s%s\">%s</a></td>"
+               "</tr>",
+               (int)e->length, prefix, e->path, e->path);
+}
+
+static void queue_page(struct chmHttpConn* c, struct chmHttpRequest* req, struct chmHttpBuf* body,
+                       const char* ctype) {
+    if (body->failed) {
+        queue_error(c, req->head, 500, "Internal error");
+    } else {
+        queue_headers(c, 200, "OK", ctype, (int64_t)body->len, "");
+        if (!req->head) {
+            buf_append(&c->out, body->data, body->len);
         }
     }
-    return NULL;
+    free(body->data);
 }
 
-static void deliver_content(FILE* fout, const char* path, struct chm_file* file) {
-    chm_entry* e;
-    const char* ext;
-    unsigned char buffer[65536];
-    int swath, offset;
+/* list the entries of an archive, whose URLs start with prefix */
+static void deliver_index(struct chmHttpWorker* w, struct chmHttpConn* c,
+                          struct chmHttpRequest* req, struct chmHttpArchive* a,
+                          const char* prefix) {
+    struct chmHttpBuf body;
+    memset(&body, 0, sizeof(body));
+    archive_load_entries(w->server, a);
+    buf_printf(&body,
+               "<h2><u>CHM contents:</u></h2>"
+               "<body><table>"
+               "<tr><td><h5>Size:</h5></td><td><h5>File:</h5></td></tr>"
+               "<tt>");
+    pthread_rwlock_rdlock(&a->lock);
+    for (int i = 0; i < a->file.n_entries; i++) {
+        print_entry_index(&body, prefix, &a->file.entries[i]);
+    }
+    pthread_rwlock_unlock(&a->lock);
+    buf_printf(&body, "</tt> </table></body></html>");
+    queue_page(c, req, &body, "text/html");
+}
+
+#ifndef CHM_HTTP_SIMPLE
+/* list the archives in the --root directory */
+static void deliver_archives(struct chmHttpConn* c, struct chmHttpRequest* req) {
+    DIR* dir = opendir(config_root);
+    if (dir == NULL) {
+        queue_error(c, req->head, 500, "Internal error");
+        return;
+    }
+    struct chmHttpBuf body;
+    memset(&body, 0, sizeof(body));
+    buf_printf(&body, "<h2><u>CHM archives:</u></h2><body><ul>");
+    struct dirent* d;
+    while ((d = readdir(dir)) != NULL) {
+        size_t len = strlen(d->d_name);
+        if (len > 4 && strcasecmp(d->d_name + len - 4, ".chm") == 0 &&
+            valid_archive_name(d->d_name)) {
+            buf_printf(&body, "<li><a href=\"/%s/\">%s</a></li>", d->d_name, d->d_name);
+        }
+    }
+    closedir(dir);
+    buf_printf(&body, "</ul></body></html>");
+    queue_page(c, req, &body, "text/html");
+}
+#endif
+
+/* vary is the Vary header line the 200 would have had, or "" */
+static void queue_not_modified(struct chmHttpConn* c, const char* etag, const char* vary) {
+    buf_printf(&c->out,
+               "HTTP/1.1 304 Not Modified\r\n"
+               "Connection: %s\r\n"
+               "ETag: %s\r\n%s\r\n",
+               c->close_after ? "close" : "keep-alive", etag, vary);
+}
+
+#ifdef HTTP_COMPRESS
+/* is e worth sending compressed? */
+static bool compressible(struct chmHttpServer* server, chm_entry* e, const char* ctype) {
+    return server->packed.max_bytes > 0 && e->length >= 256 && strncmp(ctype, "text/", 5) == 0;
+}
+
+/* answer with e from the cache of compressed entries, if the client takes
+ * that. Returns false if it should get the plain entry instead. Ranges are
+ * always of the plain entry */
+static bool deliver_packed(struct chmHttpWorker* w, struct chmHttpConn* c,
+                           struct chmHttpRequest* req, struct chmHttpArchive* a, chm_entry* e,
+                           const char* etag) {
+    static const char* const names[] = {"gzip", "br"};
+    static const char* const tags[] = {"gz", "br"};
+
+    const char* accept = find_header(req, "Accept-Encoding");
+    int encoding = -1;
+#ifdef CHM_HTTP_BROTLI
+    if (accepts_encoding(accept, "br")) {
+        encoding = ENCODING_BROTLI;
+    }
+#endif
+#ifdef CHM_HTTP_GZIP
+    if (encoding < 0 && accepts_encoding(accept, "gzip")) {
+        encoding = ENCODING_GZIP;
+    }
+#endif
+    if (encoding < 0 || find_header(req, "Range") != NULL) {
+        return false;
+    }
+
+    /* the compressed entry is a different representation, so needs its own tag */
+    char packedTag[72];
+    snprintf(packedTag, sizeof(packedTag), "%.*s-%s\"", (int)strlen(etag) - 1, etag,
+             tags[encoding]);
+    if (etag_matches(find_header(req, "If-None-Match"), packedTag)) {
+        queue_not_modified(c, packedTag, "Vary: Accept-Encoding\r\n");
+        return true;
+    }
+
+    struct chmHttpPacked* p = acquire_packed(w, a, e, encoding);
+    if (p == NULL) {
+        return false;
+    }
+    bool sent = p->data != NULL;
+    if (sent) {
+        char extra[192];
+        snprintf(extra, sizeof(extra),
+                 "Content-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %s\r\n",
+                 names[encoding], packedTag);
+        queue_headers(c, 200, "OK", lookup_mime(strrchr(req->path, '.')), (int64_t)p->len,
+                      extra);
+        if (!req->head) {
+            buf_append(&c->out, (const char*)p->data, p->len);
+        }
+    }
+    release_packed(w->server, p);
+    return sent;
+}
+#endif
+
+static void print_archive_stats(struct chmHttpBuf* b, struct chmHttpArchive* a) {
+    chm_stats st;
+    chm_get_stats(&a->file, &st);
+    int64_t lookups = st.cache.hits + st.cache.misses;
+    buf_printf(b,
+               "archive %s\n"
+               "reads %lld\n"
+               "read_bytes %lld\n"
+               "blocks_decoded %lld\n"
+               "blocks_redecoded %lld\n"
+               "checkpoint_restores %lld\n"
+               "blocks_deduped %lld\n"
+               "decode_ms %.3f\n"
+               "cache_hits %lld\n"
+               "cache_misses %lld\n"
+               "cache_hit_rate %.4f\n"
+               "cache_evictions %lld\n"
+               "cache_blocks %lld\n"
+               "cache_bytes %lld\n"
+               "cache_max_bytes %lld\n\n",
+               a->name, (long long)st.reads, (long long)st.read_bytes,
+               (long long)st.blocks_decoded, (long long)st.blocks_redecoded,
+               (long long)st.checkpoint_restores, (long long)st.blocks_deduped,
+               (double)st.decode_ns / 1e6,
+               (long long)st.cache.hits, (long long)st.cache.misses,
+               lookups ? (double)st.cache.hits / (double)lookups : 0.0,
+               (long long)st.cache.evictions, (long long)st.cache.blocks,
+               (long long)st.cache.bytes, (long long)st.cache.max_bytes);
+}
+
+/* counters of the library and the server, as "name value" lines */
+static void deliver_stats(struct chmHttpServer* server, struct chmHttpConn* c,
+                          struct chmHttpRequest* req) {
+    static const char* const histograms[] = {"read", "decode"};
+    struct chmHttpBuf body;
+    memset(&body, 0, sizeof(body));
+
+    pthread_mutex_lock(&server->lock);
+    if (server->single != NULL) {
+        print_archive_stats(&body, server->single);
+    }
+    for (struct chmHttpArchive* a = server->lru_head; a != NULL; a = a->next) {
+        print_archive_stats(&body, a);
+    }
+    buf_printf(&body, "open_archives %d\ndirectory_bytes %lld\n", server->n_open,
+               (long long)server->dir_memory);
+    pthread_mutex_unlock(&server->lock);
+
+#ifdef HTTP_COMPRESS
+    struct chmHttpPackCache* pc = &server->packed;
+    pthread_mutex_lock(&pc->lock);
+    buf_printf(&body,
+               "compressed_entries %lld\n"
+               "compressed_bytes %lld\n"
+               "compressed_max_bytes %lld\n"
+               "compressed_hits %lld\n"
+               "compressed_misses %lld\n",
+               (long long)pc->n_packed, (long long)pc->bytes, (long long)pc->max_bytes,
+               (long long)pc->hits, (long long)pc->misses);
+    pthread_mutex_unlock(&pc->lock);
+#endif
+
+    for (int i = 0; i < 2; i++) {
+        for (int n = 0; n < LATENCY_BUCKETS; n++) {
+            int64_t count = __atomic_load_n(&server->latency[i][n], __ATOMIC_RELAXED);
+            if (count > 0) {
+                buf_printf(&body, "%s_under_%lldus %lld\n", histograms[i], 1LL << n,
+                           (long long)count);
+            }
+        }
+    }
+
+    queue_page(c, req, &body, "text/plain");
+}
+
+static void deliver_content(struct chmHttpWorker* w, struct chmHttpConn* c,
+                            struct chmHttpRequest* req) {
+    struct chmHttpServer* server = w->server;
+    const char* path = req->path;
+    char name[256] = "";
+    char prefix[sizeof(name) + 1] = "";
+
+    if (strcmp(path, "/stats") == 0) {
+        deliver_stats(server, c, req);
+        return;
+    }
+
+#ifndef CHM_HTTP_SIMPLE
+    if (server->single == NULL) {
+        /* /<archive>/<path in the archive> */
+        if (strcmp(path, "/") == 0) {
+            deliver_archives(c, req);
+            return;
+        }
+        const char* end = strchr(path + 1, '/');
+        size_t len = end ? (size_t)(end - path - 1) : strlen(path + 1);
+        if (len >= sizeof(name)) {
+            queue_error(c, req->head, 404, "File not found");
+            return;
+        }
+        memcpy(name, path + 1, len);
+        name[len] = '\0';
+        snprintf(prefix, sizeof(prefix), "/%s", name);
+        path = end ? end : "/";
+    }
+#endif
+
+    struct chmHttpArchive* a = acquire_archive(server, name);
+    if (a == NULL) {
+        queue_error(c, req->head, 404, "File not found");
+        return;
+    }
 
     if (strcmp(path, "/") == 0) {
-        deliver_index(fout, file);
-        fclose(fout);
+        deliver_index(w, c, req, a, prefix);
+        release_archive(server, a);
         return;
     }
 
-    e = find_entry_by_path(file, path);
+    chm_entry* e = archive_find(a, path);
     if (e == NULL) {
-        fprintf(fout, CONTENT_404);
-        fclose(fout);
+        queue_error(c, req->head, 404, "File not found");
+        release_archive(server, a);
         return;
     }
 
-    /* send the file back */
-    ext = strrchr(path, '.');
-    fprintf(
-        fout,
-        "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: %d\r\nContent-Type: %s\r\n\r\n",
-        (int)e->length, lookup_mime(ext));
-
-    /* pump the data out */
-    swath = 65536;
-    offset = 0;
-    while (offset < e->length) {
-        if ((e->length - offset) < 65536)
-            swath = (int)(e->length - offset);
-        else
-            swath = 65536;
-        swath = (int)chm_retrieve_entry(file, e, buffer, offset, swath);
-        offset += swath;
-        fwrite(buffer, 1, (size_t)swath, fout);
-    }
-    fclose(fout);
-}
-
-static void service_request(int fd, struct chm_file* file) {
-    char buffer[4096];
-    char buffer2[4096];
-    char* end;
-    FILE* fout = fdopen(fd, "w+b");
-    if (fout == NULL) {
-        perror("chm_http: failed to fdopen client stream");
-        write(fd, INTERNAL_ERROR, strlen(INTERNAL_ERROR));
-        close(fd);
+    /* entries never change while the archive does, so they're named by the
+     * archive's timestamp and where they are in it */
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%x-%llx-%llx\"", a->file.itsf.last_modified,
+             (unsigned long long)e->start, (unsigned long long)e->length);
+    const char* ctype = lookup_mime(strrchr(path, '.'));
+    const char* vary = "";
+#ifdef HTTP_COMPRESS
+    bool packable = compressible(server, e, ctype);
+    if (packable) {
+        vary = "Vary: Accept-Encoding\r\n";
+    }
+#endif
+    if (etag_matches(find_header(req, "If-None-Match"), etag)) {
+        queue_not_modified(c, etag, vary);
+        release_archive(server, a);
         return;
     }
 
-    fgets(buffer, 4096, fout);
+#ifdef HTTP_COMPRESS
+    if (packable) {
+        if (deliver_packed(w, c, req, a, e, etag)) {
+            release_archive(server, a);
+            return;
+        }
+    }
+#endif
+
+    int64_t first = 0;
+    int64_t last = e->length - 1;
+    int range = 0;
+    const char* ifRange = find_header(req, "If-Range");
+    if (ifRange == NULL || strcmp(ifRange, etag) == 0) {
+        range = parse_range(find_header(req, "Range"), e->length, &first, &last);
+    }
+
+    char extra[256];
+    if (range < 0) {
+        snprintf(extra, sizeof(extra), "Content-Range: bytes */%lld\r\n", (long long)e->length);
+        queue_headers(c, 416, "Range Not Satisfiable", ctype, 0, extra);
+        release_archive(server, a);
+        return;
+    }
+    int len =
+        snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\nETag: %s\r\n%s", etag, vary);
+    if (range > 0) {
+        snprintf(extra + len, sizeof(extra) - (size_t)len,
+                 "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)first, (long long)last,
+                 (long long)e->length);
+    }
+
+    /* the data follows the headers once they're written, see conn_flush() */
+    queue_headers(c, range > 0 ? 206 : 200, range > 0 ? "Partial Content" : "OK", ctype,
+                  last + 1 - first, extra);
+    if (!req->head && last >= first) {
+        c->archive = a;
+        c->body = e;
+        c->body_addr = first;
+        c->body_end = last + 1;
+    } else {
+        release_archive(server, a);
+    }
+}
+
+/* answer the first complete request in the input. Returns false if there's none yet */
+static bool conn_next_request(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    /* the request ends with an empty line */
+    size_t end = 0;
+    for (size_t i = 0; i < c->in_len && end == 0; i++) {
+        if (c->in[i] != '\n') {
+            continue;
+        }
+        if (i + 1 < c->in_len && c->in[i + 1] == '\n') {
+            end = i + 2;
+        } else if (i + 2 < c->in_len && c->in[i + 1] == '\r' && c->in[i + 2] == '\n') {
+            end = i + 3;
+        }
+    }
+    if (end == 0) {
+        if (c->in_len < sizeof(c->in)) {
+            return false;
+        }
+        c->close_after = true;
+        c->in_len = 0;
+        queue_error(c, false, 400, "Bad request");
+        return true;
+    }
+
+    struct chmHttpRequest req;
+    c->in[end - 1] = '\0';
+    if (!parse_request(c->in, c->in + end - 1, &req)) {
+        c->close_after = true;
+        queue_error(c, false, 500, "Unknown thing");
+    } else {
+        c->close_after = !req.keep_alive;
+        deliver_content(w, c, &req);
+    }
+
+    /* keep any pipelined requests that follow */
+    memmove(c->in, c->in + end, c->in_len - end);
+    c->in_len -= end;
+    return true;
+}
+
+/* returns 1 when everything was written, 0 if the socket would block and -1
+ * if the connection failed */
+static int write_out(struct chmHttpConn* c) {
+    while (c->out_off < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_off, c->out.len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out.len = 0;
+    c->out_off = 0;
+    return 1;
+}
+
+/* pump the data straight from the library's buffers to the socket, sending
+ * the headers along with the first piece */
+static int write_body_view(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    chm_view view;
+    int res = 1;
+
+    chm_session* session = archive_session(w, c->archive);
+    if (session == NULL ||
+        !chm_retrieve_view(session, c->body, c->body_addr, c->body_end - c->body_addr, &view)) {
+        return -1;
+    }
+    while (res == 1 && chm_view_next(&view)) {
+        const uint8_t* d = view.data;
+        int64_t len = view.len;
+        while (len > 0) {
+            struct iovec iov[2];
+            int n = 0;
+            size_t headerLen = c->out.len - c->out_off;
+            if (headerLen > 0) {
+                iov[n].iov_base = c->out.data + c->out_off;
+                iov[n].iov_len = headerLen;
+                n++;
+            }
+            iov[n].iov_base = (void*)d;
+            iov[n].iov_len = (size_t)len;
+            n++;
+
+            ssize_t written = writev(c->fd, iov, n);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                res = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+                break;
+            }
+            size_t fromHeader = (size_t)written < headerLen ? (size_t)written : headerLen;
+            c->out_off += fromHeader;
+            written -= (ssize_t)fromHeader;
+            d += written;
+            len -= written;
+            c->body_addr += written;
+        }
+    }
+    if (view.failed) {
+        res = -1;
+    }
+    chm_view_close(&view);
+    return res;
+}
+
+#ifdef __linux__
+/* uncompressed data of an archive that isn't mapped goes out with sendfile() */
+static int write_body_sendfile(struct chmHttpConn* c) {
+    int res = write_out(c);
+    if (res != 1) {
+        return res;
+    }
+    chm_file* file = &c->archive->file;
+    off_t off = (off_t)(file->itsf.data_offset + c->body->start + c->body_addr);
+    while (c->body_addr < c->body_end) {
+        ssize_t n =
+            sendfile(c->fd, c->archive->file_fd, &off, (size_t)(c->body_end - c->body_addr));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            /* truncated archive */
+            return -1;
+        }
+        c->body_addr += n;
+    }
+    return 1;
+}
+#endif
+
+static int conn_flush(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    if (c->out.failed) {
+        return -1;
+    }
+    if (c->body != NULL) {
+        int res;
+#ifdef __linux__
+        if (c->archive->file_fd >= 0 && c->body->space == CHM_UNCOMPRESSED) {
+            res = write_body_sendfile(c);
+        } else
+#endif
+        {
+            res = write_body_view(w, c);
+        }
+        if (res != 1) {
+            return res;
+        }
+        if (c->body_addr != c->body_end) {
+            return -1;
+        }
+        c->body = NULL;
+        release_archive(w->server, c->archive);
+        c->archive = NULL;
+    }
+    return write_out(c);
+}
+
+static void conn_unlink(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    if (c->prev == NULL && w->conns_head != c) {
+        /* not in the list yet */
+        return;
+    }
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        w->conns_head = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    } else {
+        w->conns_tail = c->prev;
+    }
+    c->prev = NULL;
+    c->next = NULL;
+}
+
+/* note traffic on c, moving it to the end of the worker's connections */
+static void conn_touch(struct chmHttpWorker* w, struct chmHttpConn* c, int64_t now) {
+    conn_unlink(w, c);
+    c->last_active = now;
+    c->prev = w->conns_tail;
+    if (w->conns_tail != NULL) {
+        w->conns_tail->next = c;
+    } else {
+        w->conns_head = c;
+    }
+    w->conns_tail = c;
+}
+
+static void conn_close(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    conn_unlink(w, c);
+    poller_del(w->poll_fd, c->fd);
+    close(c->fd);
+    release_archive(w->server, c->archive);
+    free(c->out.data);
+    free(c);
+}
+
+/* wait for input or for room to write */
+static bool conn_watch(struct chmHttpWorker* w, struct chmHttpConn* c, bool write) {
+    if (c->want_write == write) {
+        return true;
+    }
+    c->want_write = write;
+    return poller_watch(w->poll_fd, c->fd, c, write) == 0;
+}
+
+/* write what's pending and answer requests, in order, until the socket would
+ * block or there's nothing left to do */
+static void conn_run(struct chmHttpWorker* w, struct chmHttpConn* c) {
     while (1) {
-        if (fgets(buffer2, 4096, fout) == NULL)
+        int res = conn_flush(w, c);
+        if (res < 0) {
             break;
-        if (buffer2[0] == '\r' || buffer2[0] == '\n' || buffer2[0] == '\0')
+        }
+        if (res == 0) {
+            if (!conn_watch(w, c, true)) {
+                break;
+            }
+            return;
+        }
+        if (c->close_after) {
             break;
+        }
+        if (!conn_next_request(w, c)) {
+            if (c->eof || !conn_watch(w, c, false)) {
+                break;
+            }
+            return;
+        }
     }
-    end = strrchr(buffer, ' ');
-    if (strncmp(end + 1, "HTTP", 4) == 0)
-        *end = '\0';
-    if (strncmp(buffer, "GET ", 4) == 0)
-        deliver_content(fout, buffer + 4, file);
-    else {
-        fprintf(fout, CONTENT_500);
-        fclose(fout);
-        return;
+    conn_close(w, c);
+}
+
+static void conn_event(struct chmHttpWorker* w, struct chmHttpConn* c) {
+    conn_touch(w, c, now_ms());
+    /* read whatever has arrived */
+    while (!c->want_write && !c->eof && c->in_len < sizeof(c->in)) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+        } else if (n == 0) {
+            /* answer what was sent before the client stopped sending */
+            c->eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            conn_close(w, c);
+            return;
+        }
+    }
+    conn_run(w, c);
+}
+
+static void accept_connections(struct chmHttpWorker* w) {
+    while (1) {
+        int fd = accept(w->server->socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            /* EAGAIN once another worker took it or there are no more. Other
+             * errors, EMFILE and ENFILE mostly, would be reported again right
+             * away since the listener stays readable, so stop watching it for
+             * a while */
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                poller_del_listener(w->poll_fd, w->server->socket);
+                w->accept_resume = now_ms() + ACCEPT_BACKOFF_MS;
+            }
+            return;
+        }
+        struct chmHttpConn* c = (struct chmHttpConn*)calloc(1, sizeof(struct chmHttpConn));
+        if (c == NULL || !set_nonblocking(fd)) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        if (poller_add(w->poll_fd, fd, c) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        conn_touch(w, c, now_ms());
+    }
+}
+
+/* close connections idle for too long and watch the listener again once the
+ * backoff has passed. Returns how long the worker may wait for events */
+static int worker_timers(struct chmHttpWorker* w) {
+    int64_t now = now_ms();
+    while (w->conns_head != NULL && now - w->conns_head->last_active >= HTTP_IDLE_TIMEOUT_MS) {
+        conn_close(w, w->conns_head);
+    }
+    if (w->accept_resume != 0 && now >= w->accept_resume) {
+        w->accept_resume = 0;
+        if (poller_add_listener(w->poll_fd, w->server->socket) < 0) {
+            w->accept_resume = now + ACCEPT_BACKOFF_MS;
+        }
+    }
+
+    int64_t timeout = -1;
+    if (w->conns_head != NULL) {
+        timeout = w->conns_head->last_active + HTTP_IDLE_TIMEOUT_MS - now;
+    }
+    if (w->accept_resume != 0 && (timeout < 0 || w->accept_resume - now < timeout)) {
+        timeout = w->accept_resume - now;
     }
+    return (int)timeout;
+}
+
+static void* worker_main(void* param) {
+    struct chmHttpWorker* w = (struct chmHttpWorker*)param;
+    void* events[MAX_EVENTS];
+
+    while (1) {
+        int n = poller_wait(w->poll_fd, events, MAX_EVENTS, worker_timers(w));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("chm_http: failed to wait for events");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i] == NULL) {
+                accept_connections(w);
+            } else {
+                conn_event(w, (struct chmHttpConn*)events[i]);
+            }
+        }
+    }
+    return NULL;
 }
@@ -62,7 +62,7 @@ static bool enum_fd(const char* path) {
         return false;
     }
     for (int i = 0; i < f.n_entries; i++) {
-        print_entry(f.entries[i]);
+        print_entry(&f.entries[i]);
     }
     if (f.parse_entries_failed) {
         return false;
@@ -33,6 +33,8 @@
 
 struct extract_context {
     const char* base_path;
+    /* file of the entry being extracted */
+    FILE* fout;
 };
 
 static int dir_exists(const char* path) {
@@ -84,11 +86,13 @@ static int rmkdir(char* path) {
 #endif
 }
 
-static bool extract_entry(chm_file* h, chm_entry* e, const char* base_path) {
+/* open the output for an entry. Sets ctx->fout to NULL for entries that are skipped */
+static bool start_entry(struct extract_context* ctx, chm_entry* e) {
     int64_t path_len;
     char buf[32768];
     char* i;
 
+    ctx->fout = NULL;
     if (e->path[0] != '/')
         return true;
 
@@ -98,7 +102,7 @@ static bool extract_entry(chm_file* h, chm_entry* e, const char* base_path) {
         return true;
     }
 
-    if (snprintf(buf, sizeof(buf), "%s%s", base_path, e->path) > 1024) {
+    if (snprintf(buf, sizeof(buf), "%s%s", ctx->base_path, e->path) > 1024) {
         return false;
     }
 
@@ -111,78 +115,92 @@ static bool extract_entry(chm_file* h, chm_entry* e, const char* base_path) {
     }
 
     /* this is file */
-    FILE* fout;
-    int64_t len, remain = (int64_t)e->length;
-    int64_t offset = 0;
-
     printf("--> %s\n", e->path);
-    if ((fout = fopen(buf, "wb")) == NULL) {
+    if ((ctx->fout = fopen(buf, "wb")) == NULL) {
         /* make sure that it isn't just a missing directory before we abort */
         char newbuf[32768];
         strcpy(newbuf, buf);
         i = strrchr(newbuf, '/');
         *i = '\0';
         rmkdir(newbuf);
-        if ((fout = fopen(buf, "wb")) == NULL)
+        if ((ctx->fout = fopen(buf, "wb")) == NULL)
             return false;
     }
+    return true;
+}
 
-    while (remain != 0) {
-        len = chm_retrieve_entry(h, e, (uint8_t*)buf, offset, sizeof(buf));
-        if (len > 0) {
-            fwrite(buf, 1, (size_t)len, fout);
-            offset += (int64_t)len;
-            remain -= len;
-        } else {
-            fprintf(stderr, "incomplete file: %s\n", e->path);
-            break;
-        }
+static bool extract_data(void* ctx_arg, chm_entry* e, int64_t addr, const uint8_t* data,
+                         int64_t len) {
+    struct extract_context* ctx = (struct extract_context*)ctx_arg;
+    if (addr == 0 && !start_entry(ctx, e)) {
+        return false;
+    }
+    if (ctx->fout == NULL) {
+        return true;
+    }
+    if (data == NULL) {
+        fprintf(stderr, "incomplete file: %s\n", e->path);
+    } else {
+        fwrite(data, 1, (size_t)len, ctx->fout);
+    }
+    if (data == NULL || addr + len == e->length) {
+        fclose(ctx->fout);
+        ctx->fout = NULL;
     }
-
-    fclose(fout);
     return true;
 }
 
-static bool extract(chm_file* h, const char* base_path) {
-    /* extract as many entries as possible */
-    for (int i = 0; i < h->n_entries; i++) {
-        if (!extract_entry(h, h->entries[i], base_path)) {
-            return false;
-        }
+static bool extract(chm_file* h, const char* base_path, int n_threads) {
+    struct extract_context ctx;
+    ctx.base_path = base_path;
+    ctx.fout = NULL;
+
+    /* extract as many entries as possible, in the order they're stored in */
+    bool ok = chm_extract_all_parallel(h, n_threads, extract_data, &ctx);
+    if (ctx.fout != NULL) {
+        fclose(ctx.fout);
     }
-    if (h->parse_entries_failed) {
+    if (!ok || h->parse_entries_failed) {
         return false;
     }
     return true;
 }
 
-static bool extract_fd(const char* path, const char* base_path) {
-    fd_reader_ctx ctx;
-    if (!fd_reader_init(&ctx, path)) {
+static bool extract_mmap(const char* path, const char* base_path, int n_threads) {
+    mmap_reader_ctx ctx;
+    if (!mmap_reader_init(&ctx, path)) {
         fprintf(stderr, "failed to open %s\n", path);
         return false;
     }
     chm_file f;
-    bool ok = chm_parse(&f, fd_reader, &ctx);
+    bool ok = chm_parse(&f, mmap_reader, &ctx);
     if (!ok) {
         fprintf(stderr, "chm_parse() failed\n");
-        fd_reader_close(&ctx);
+        mmap_reader_close(&ctx);
         return false;
     }
     printf("%s:\n", path);
-    ok = extract(&f, base_path);
+    chm_advise_sequential(&f);
+    ok = extract(&f, base_path, n_threads);
     chm_close(&f);
-    fd_reader_close(&ctx);
+    mmap_reader_close(&ctx);
     return ok;
 }
 
 int main(int c, char** v) {
-    if (c < 3) {
-        fprintf(stderr, "usage: %s <chmfile> <outdir>\n", v[0]);
+    int n_threads = 1;
+    char** args = v + 1;
+    if (c >= 3 && strcmp(args[0], "-j") == 0) {
+        n_threads = atoi(args[1]);
+        args += 2;
+        c -= 2;
+    }
+    if (c < 3 || n_threads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] <chmfile> <outdir>\n", v[0]);
         exit(1);
     }
 
-    bool ok = extract_fd(v[1], v[2]);
+    bool ok = extract_mmap(args[0], args[1], n_threads);
     if (!ok) {
         printf("   *** ERROR ***\n");
     }
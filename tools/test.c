@@ -9,6 +9,7 @@
 
 #include "chm_lib.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,26 +39,38 @@ static void sha1_to_hex(uint8_t* sha1, char* sha1Hex) {
     }
 }
 
-static uint8_t* extract_entry(struct chm_file* h, chm_entry* e) {
-    int64_t len = (int64_t)e->length;
+/* SHA1 of every entry, computed in one pass over the archive by hash_data() */
+typedef struct hash_ctx {
+    chm_file* h;
+    /* indexed like h->entries, all zeros for empty entries and ones that can't be read */
+    uint8_t (*sha1)[20];
+    /* state of the entry being hashed; chm_extract_all() passes one entry at a time */
+    sha1_state state;
+    bool failed;
+} hash_ctx;
 
-    uint8_t* buf = (uint8_t*)malloc((size_t)len + 1);
-    if (buf == NULL) {
-        return NULL;
+static bool hash_data(void* ctx, chm_entry* e, int64_t addr, const uint8_t* data, int64_t len) {
+    hash_ctx* hc = (hash_ctx*)ctx;
+    uint8_t* sha1 = hc->sha1[e - hc->h->entries];
+    if (addr == 0) {
+        sha1_init(&hc->state);
     }
-    buf[len] = 0; /* null-terminate just in case */
-
-    int64_t n = chm_retrieve_entry(h, e, buf, 0, len);
-    if (n != len) {
-        free(buf);
-        return NULL;
+    if (data == NULL) {
+        /* partially read entries get the same zeros as unreadable ones */
+        return true;
+    }
+    if (sha1_process(&hc->state, data, (unsigned long)len) != CRYPT_OK) {
+        hc->failed = true;
+        return false;
     }
-    return buf;
+    if (len > 0 && addr + len == (int64_t)e->length) {
+        sha1_done(&hc->state, sha1);
+    }
+    return true;
 }
 
-static bool process_entry(struct chm_file* h, chm_entry* e) {
+static void print_entry(FILE* out, chm_entry* e, uint8_t* sha1) {
     char buf[128] = {0};
-    uint8_t sha1[20] = {0};
     char sha1Hex[41] = {0};
 
     int isFile = e->flags & CHM_ENUMERATE_FILES;
@@ -72,42 +85,48 @@ static bool process_entry(struct chm_file* h, chm_entry* e) {
     else if (isFile)
         strcat(buf, "file");
 
-    if (e->length > 0) {
-        uint8_t* d = extract_entry(h, e);
-        if (d != NULL) {
-            int err = sha1_process_all(d, (unsigned long)e->length, sha1);
-            free(d);
-            if (err != CRYPT_OK) {
-                return false;
-            }
-        }
-    }
-
     sha1_to_hex(sha1, sha1Hex);
     if (needs_csv_escaping(e->path)) {
-        printf("%d,%d,%d,%s,%s,\"%s\"\n", (int)e->space, (int)e->start, (int)e->length, buf,
-               sha1Hex, e->path);
+        fprintf(out, "%d,%d,%d,%s,%s,\"%s\"\n", (int)e->space, (int)e->start, (int)e->length,
+                buf, sha1Hex, e->path);
     } else {
-        printf("%1d,%d,%d,%s,%s,%s\n", (int)e->space, (int)e->start, (int)e->length, buf, sha1Hex,
-               e->path);
+        fprintf(out, "%1d,%d,%d,%s,%s,%s\n", (int)e->space, (int)e->start, (int)e->length, buf,
+                sha1Hex, e->path);
     }
-    return true;
 }
 
-static bool test_chm(chm_file* h) {
+/* hash the entries in stream order, so every block is decoded once and no entry
+ * is held in memory, then print them in directory order */
+static bool test_chm(chm_file* h, FILE* out, int n_threads) {
+    hash_ctx hc = {0};
+    hc.h = h;
+    hc.sha1 = (uint8_t(*)[20])calloc((size_t)h->n_entries + 1, sizeof(hc.sha1[0]));
+    if (hc.sha1 == NULL) {
+        fprintf(out, "   *** ERROR ***\n");
+        return false;
+    }
+    bool ok;
+    if (n_threads > 1) {
+        ok = chm_extract_all_parallel(h, n_threads, hash_data, &hc);
+    } else {
+        ok = chm_extract_all(h, hash_data, &hc);
+    }
+    if (!ok) {
+        fprintf(out, "   *** ERROR ***\n");
+        free(hc.sha1);
+        return false;
+    }
     for (int i = 0; i < h->n_entries; i++) {
-        if (!process_entry(h, h->entries[i])) {
-            printf("   *** ERROR ***\n");
-            return false;
-        }
+        print_entry(out, &h->entries[i], hc.sha1[i]);
     }
     if (h->parse_entries_failed) {
-        printf("   *** ERROR ***\n");
+        fprintf(out, "   *** ERROR ***\n");
     }
+    free(hc.sha1);
     return true;
 }
 
-static bool test_fd(const char* path) {
+static bool test_fd(const char* path, FILE* out, int n_threads) {
     fd_reader_ctx ctx;
     if (!fd_reader_init(&ctx, path)) {
         fprintf(stderr, "failed to open %s\n", path);
@@ -120,12 +139,90 @@ static bool test_fd(const char* path) {
         fd_reader_close(&ctx);
         return false;
     }
-    ok = test_chm(&f);
+    ok = test_chm(&f, out, n_threads);
     chm_close(&f);
     fd_reader_close(&ctx);
     return ok;
 }
 
+/* archives hashed by test_worker() threads, each into its own temporary file
+ * that main() copies to stdout in argument order */
+typedef struct test_job {
+    const char* path;
+    FILE* out;
+    bool ok;
+} test_job;
+
+typedef struct test_jobs {
+    pthread_mutex_t lock;
+    test_job* jobs;
+    int n_jobs;
+    int next;
+} test_jobs;
+
+static void* test_worker(void* arg) {
+    test_jobs* tj = (test_jobs*)arg;
+    while (true) {
+        pthread_mutex_lock(&tj->lock);
+        int i = tj->next++;
+        pthread_mutex_unlock(&tj->lock);
+        if (i >= tj->n_jobs) {
+            return NULL;
+        }
+        test_job* j = &tj->jobs[i];
+        j->out = tmpfile();
+        j->ok = j->out != NULL && test_fd(j->path, j->out, 1);
+    }
+}
+
+static bool test_many(char** paths, int n, int n_threads) {
+    test_jobs tj;
+    tj.jobs = (test_job*)calloc((size_t)n, sizeof(test_job));
+    pthread_t* threads = (pthread_t*)calloc((size_t)n_threads, sizeof(pthread_t));
+    if (tj.jobs == NULL || threads == NULL) {
+        free(tj.jobs);
+        free(threads);
+        return false;
+    }
+    pthread_mutex_init(&tj.lock, NULL);
+    tj.n_jobs = n;
+    tj.next = 0;
+    for (int i = 0; i < n; i++) {
+        tj.jobs[i].path = paths[i];
+    }
+    int n_started = 0;
+    while (n_started < n_threads &&
+           pthread_create(&threads[n_started], NULL, test_worker, &tj) == 0) {
+        n_started++;
+    }
+    if (n_started == 0) {
+        test_worker(&tj);
+    }
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool ok = true;
+    char buf[16 * 1024];
+    for (int i = 0; i < n; i++) {
+        test_job* j = &tj.jobs[i];
+        ok = ok && j->ok;
+        if (j->out == NULL) {
+            continue;
+        }
+        rewind(j->out);
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), j->out)) > 0) {
+            fwrite(buf, 1, len, stdout);
+        }
+        fclose(j->out);
+    }
+    pthread_mutex_destroy(&tj.lock);
+    free(threads);
+    free(tj.jobs);
+    return ok;
+}
+
 static bool show_dbg_out = false;
 
 static void dbg_print(const char* s) {
@@ -133,14 +230,28 @@ static void dbg_print(const char* s) {
 }
 
 int main(int c, char** v) {
-    if (c < 2) {
-        fprintf(stderr, "usage: %s <chmfile>\n", v[0]);
+    int n_threads = 1;
+    char** args = v + 1;
+    if (c >= 3 && strcmp(args[0], "-j") == 0) {
+        n_threads = atoi(args[1]);
+        args += 2;
+        c -= 2;
+    }
+    if (c < 2 || n_threads < 1) {
+        fprintf(stderr, "usage: %s [-j threads] <chmfile>...\n", v[0]);
         exit(1);
     }
     if (show_dbg_out) {
         chm_set_dbgprint(dbg_print);
     }
-    bool ok = test_fd(v[1]);
+    /* -j decompresses one archive on n threads, or hashes n archives at once */
+    bool ok;
+    if (c == 2) {
+        ok = test_fd(args[0], stdout, n_threads);
+    } else {
+        int n = c - 1;
+        ok = test_many(args, n, n_threads < n ? n_threads : n);
+    }
     if (ok) {
         return 0;
     }